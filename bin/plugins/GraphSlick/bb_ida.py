@@ -31,10 +31,11 @@ stdalone = False
 """Desginates whether this module is running inside IDA or in stand alone mode"""
 
 # ------------------------------------------------------------------------------
+import hashlib
+
 try:
     import idaapi
     import idautils
-    import hashlib
 
     from idaapi import UA_MAXOP, o_last, o_void
 except:
@@ -45,12 +46,88 @@ except:
     o_void    = 0
 
 from   bb_types import *
+from   bb_store import *
 import bb_utils
+import struct
+
+# ------------------------------------------------------------------------------
+STORE_FILENAME = "graphslick.bbstore"
+"""The basic blocks store shared by all the functions"""
+
+_Store = None
+
+def _get_store():
+    """Return the basic blocks store, opening it on first use"""
+    global _Store
+    if _Store is None:
+        _Store = BBStore(STORE_FILENAME)
+    return _Store
+
 
 # ------------------------------------------------------------------------------
-def _get_cache_filename(addr):
-    # Form the cache file name
-    return "%016X.cache" % addr
+def block_digest(start, end):
+    """
+    Return the content digest of a block: the raw SHA1 of its bounds and bytes.
+    It changes when the block is patched or its bounds are re-analyzed
+    """
+    sh = hashlib.sha1()
+    sh.update(struct.pack('<QQ', start, end))
+    sh.update(idaapi.get_many_bytes(start, end - start) or '')
+    return sh.digest()
+
+
+# ------------------------------------------------------------------------------
+def function_digest(block_digests):
+    """
+    Return the content digest of a function from the digests of its blocks
+    @param block_digests: Dictionary: block id -> content digest
+    """
+    sh = hashlib.sha1()
+    for id in sorted(block_digests):
+        sh.update(struct.pack('<i', id))
+        sh.update(block_digests[id])
+    return sh.digest()
+
+
+# ------------------------------------------------------------------------------
+def check_stored_digest(rec, expected_digest = None):
+    """
+    Check a store record against its own block digests when the database
+    cannot be read to recompute them (standalone mode).
+    @param expected_digest: Function digest the caller knows, or None
+    @return: None if the record can be used or the reason it cannot
+    """
+    if rec is None:
+        return "No record in the store"
+
+    try:
+        digests = rec.block_digests()
+    except (struct.error, ValueError) as e:
+        return "Bad record in the store: %s" % e
+
+    # Blocks saved without a digest cannot be checked
+    if not digests or '\0' * DIGEST_SIZE in digests.values():
+        return "The stored blocks have no content digests"
+
+    if function_digest(digests) != rec.digest:
+        return "The stored blocks do not match the function digest"
+
+    if expected_digest is not None and rec.digest != expected_digest:
+        return "The stored function digest does not match"
+
+    return None
+
+
+# ------------------------------------------------------------------------------
+def unique_block_ids(blocks):
+    """Return the ids of a list of blocks without the duplicates, in order"""
+    seen = set()
+    ids = []
+    for block in blocks:
+        if block.id not in seen:
+            seen.add(block.id)
+            ids.append(block.id)
+    return ids
 
 
 # ------------------------------------------------------------------------------
@@ -89,84 +166,177 @@ def get_cmd_prime_characteristics(cmd):
 
 
 # ------------------------------------------------------------------------------
-def hash_itype1(start, end):
-    """Hash a block based on the instruction sequence"""
-    sh  = hashlib.sha1()
-    buf = []    
+def decode_block(start, end):
+    """
+    Decode the instructions of a block once.
+    Returns a list of (itype, operand characteristics) tuples. The operand
+    characteristics are the primes pool indices of the operands
+    """
+    insns = []
     while start < end:
         cmd = idautils.DecodeInstruction(start)
         if cmd is None:
             break
 
-        buf.append(str(cmd.itype))
+        ops = []
+        for op in cmd.Operands:
+            if op.type == o_void:
+                break
+            ops.append(_OP_P_OFFS + ((op.n * o_last) + op.type))
+
+        insns.append((cmd.itype, tuple(ops)))
+
+        # Advance decoder
         start += cmd.size
 
-    sh.update("".join(buf))
+    return insns
+
 
+# ------------------------------------------------------------------------------
+def insns_hash_itype1(insns):
+    """Hash the itype sequence of decoded instructions"""
+    sh  = hashlib.sha1()
+    sh.update("".join([str(itype) for itype, ops in insns]))
     return sh.hexdigest()
 
 
 # ------------------------------------------------------------------------------
-def hash_itype2(start, end):
+def insns_hash_itype2(insns):
     """
-    Hash a block based on the instruction sequence.
-    Take into consideration the operands
+    Hash the itypes and operands of decoded instructions.
+    The order of the instructions is not taken into account: instead of
+    multiplying the primes of get_cmd_prime_characteristics() we sum up
+    two 64-bit keys per itype and operand characteristic
     """
-    sh  = hashlib.sha1()
-    r = 1
-    while start < end:
-        cmd = idautils.DecodeInstruction(start)
-        if cmd is None:
-            break
+    h1 = h2 = 0
+    for itype, ops in insns:
+        k1, k2 = _CachedKeys[itype]
+        h1 += k1
+        h2 += k2
 
-        r = r * get_cmd_prime_characteristics(cmd)
+        # Same pool index as the operand prime
+        for op in ops:
+            k1, k2 = _CachedKeys[op]
+            h1 += k1
+            h2 += k2
+
+    return "%016x%016x" % (h1 & _KEY_MASK, h2 & _KEY_MASK)
+
+
+# ------------------------------------------------------------------------------
+def insn_prime_characteristics(insn):
+    """Return the prime characteristics of a decoded instruction"""
+    itype, ops = insn
+    r = _CachedPrimes[itype]
+    for op in ops:
+        r = r * _CachedPrimes[op]
+    return r
 
-        # Advance decoder
-        start += cmd.size
 
+# ------------------------------------------------------------------------------
+def insns_hash_itype2_prime(insns):
+    """Hash the product of the prime characteristics of decoded instructions"""
+    sh  = hashlib.sha1()
+    r = 1
+    for insn in insns:
+        r = r * insn_prime_characteristics(insn)
     sh.update(str(r))
     return sh.hexdigest()
 
 
 # ------------------------------------------------------------------------------
-def get_block_frequency(start, end, rekey=False):
+def insns_block_frequency(insns, rekey=False):
     """
-    Compute a table of instruction characteristic freqency
+    Compute the characteristic frequency table of decoded instructions
     Returns a tuple containing the total instruction count and freqency table
     """
     d  = {}
-    t  = 0
-    while start < end:
-        # Decode the instruction
-        cmd = idautils.DecodeInstruction(start)
-        if cmd is None:
-            break
+    for insn in insns:
+        # Add up the frequency count of the prime characteristics
+        r = insn_prime_characteristics(insn)
+        d[r] = d.get(r, 0) + 1
 
-        # Get the prime characteristics
-        r = get_cmd_prime_characteristics(cmd)
+    # Return a simpler dictionary
+    if rekey:
+        d = bb_utils.RekeyDictionary(d)
 
-        # See if this characteristic has been seen already
-        try:
-            # Yes, take its frequency count
-            v = d[r]
-        except:
-            # No, zero frequency
-            v = 0
+    return (len(insns), d)
 
-        # Add up the frequency count
-        d[r] = v + 1
 
-        # Add the instruction count
-        t += 1
+# ------------------------------------------------------------------------------
+def hash_itype1(start, end):
+    """Hash a block based on the instruction sequence"""
+    return insns_hash_itype1(decode_block(start, end))
 
-        # Advance decoder
-        start += cmd.size
 
-    # Return a simpler dictionary
-	if rekey:
-		d = bb_utils.RekeyDictionary(d)
-    
-    return (t, d)
+# ------------------------------------------------------------------------------
+def hash_itype2(start, end):
+    """
+    Hash a block based on the instruction sequence.
+    Take into consideration the operands
+    """
+    return insns_hash_itype2(decode_block(start, end))
+
+
+# ------------------------------------------------------------------------------
+def hash_itype2_prime(start, end):
+    """
+    Reference version of hash_itype2(): hash the product of the instruction
+    characteristics primes
+    """
+    return insns_hash_itype2_prime(decode_block(start, end))
+
+
+# ------------------------------------------------------------------------------
+def CheckHashItype2Compat(func_addrs=None):
+    """
+    Check on a corpus of functions that hash_itype2() groups the blocks
+    exactly like hash_itype2_prime() does
+    @param func_addrs: The functions to check. All the functions by default
+    Returns a tuple (checked blocks count, list of the conflicting block addresses)
+    """
+    if func_addrs is None:
+        func_addrs = idautils.Functions()
+
+    old2new = {}
+    new2old = {}
+    count = 0
+    conflicts = []
+    for func_addr in func_addrs:
+        fnc = idaapi.get_func(func_addr)
+        if fnc is None:
+            continue
+
+        for block in idaapi.FlowChart(fnc):
+            count += 1
+            insns = decode_block(block.startEA, block.endEA)
+            h_old = insns_hash_itype2_prime(insns)
+            h_new = insns_hash_itype2(insns)
+            if old2new.setdefault(h_old, h_new) != h_new or new2old.setdefault(h_new, h_old) != h_old:
+                conflicts.append(block.startEA)
+
+    return (count, conflicts)
+
+
+# ------------------------------------------------------------------------------
+def get_block_frequency(start, end, rekey=False):
+    """
+    Compute a table of instruction characteristic freqency
+    Returns a tuple containing the total instruction count and freqency table
+    """
+    return insns_block_frequency(decode_block(start, end), rekey)
+
+
+# ------------------------------------------------------------------------------
+def get_bb_frequency(bb):
+    """
+    Return the frequency table of a basic block.
+    Use the one computed with the block context if it is available
+    """
+    ft = getattr(getattr(bb, 'ctx', None), 'freq_table', None)
+    if ft is None:
+        ft = get_block_frequency(bb.start, bb.end)
+    return ft
 
 
 # ------------------------------------------------------------------------------
@@ -251,6 +421,12 @@ class IdaBBContext(object):
         self.inst_count = 0
         """Instruction count"""
 
+        self.insns = None
+        """The decoded instructions: list of (itype, operand characteristics)"""
+
+        self.freq_table = None
+        """Instruction characteristics frequency table: (total, table)"""
+
 
     def get_context(
             self,
@@ -258,23 +434,126 @@ class IdaBBContext(object):
             bytes=True, 
             itype1=True, 
             itype2=False,
-            icount=True):
+            icount=True,
+            freq=True):
         """Compute the context of a basic block"""
         # Get the bytes
         if bytes:
             self.bytes = idaapi.get_many_bytes(bb.start, bb.end - bb.start)
 
+        # Decode the block once and compute the other features from the instructions
+        if not (icount or itype1 or itype2 or freq):
+            return
+
+        self.insns = decode_block(bb.start, bb.end)
+
         # Count instructions
         if icount:
-            self.inst_count = InstructionCount(bb.start, bb.end)
+            self.inst_count = len(self.insns)
         
         # Get the itype1 hash
         if itype1:
-            self.hash_itype1 = hash_itype1(bb.start, bb.end)
+            self.hash_itype1 = insns_hash_itype1(self.insns)
 
         # Get the itype2 hash
         if itype2:
-            self.hash_itype2 = hash_itype2(bb.start, bb.end)
+            self.hash_itype2 = insns_hash_itype2(self.insns)
+
+        # Get the frequency table
+        if freq:
+            self.freq_table = insns_block_frequency(self.insns)
+
+
+    @staticmethod
+    def FromStore(rec, i, icount, flags):
+        """Build the context of the i-th block of a BBStore record"""
+        return StoredBBContext(rec, i, icount, flags)
+
+
+# ------------------------------------------------------------------------------
+def _stored_bytes(ctx):
+    if ctx._flags & BBF_BYTES:
+        return ctx._rec.bytes(ctx._i)
+    return None
+
+
+# ------------------------------------------------------------------------------
+def _stored_hash_itype1(ctx):
+    if ctx._flags & BBF_HASH1:
+        return ctx._rec.hash_itype1(ctx._i)
+    return None
+
+
+# ------------------------------------------------------------------------------
+def _stored_hash_itype2(ctx):
+    if ctx._flags & BBF_HASH2:
+        return ctx._rec.hash_itype2(ctx._i)
+    return None
+
+
+# ------------------------------------------------------------------------------
+def _stored_insns(ctx):
+    if ctx._flags & BBF_INSNS:
+        return ctx._rec.insns(ctx._i)
+    return None
+
+
+# ------------------------------------------------------------------------------
+def _stored_freq_table(ctx):
+    if ctx._flags & BBF_FREQ:
+        return ctx._rec.freq_table(ctx._i)
+
+    # Block saved without its frequency table
+    if ctx.insns is not None:
+        return insns_block_frequency(ctx.insns)
+    return None
+
+
+# ------------------------------------------------------------------------------
+# Loaders of the features of a StoredBBContext
+_STORED_FEATURES = {
+    'bytes':       _stored_bytes,
+    'hash_itype1': _stored_hash_itype1,
+    'hash_itype2': _stored_hash_itype2,
+    'insns':       _stored_insns,
+    'freq_table':  _stored_freq_table
+}
+
+
+# ------------------------------------------------------------------------------
+class StoredBBContext(IdaBBContext):
+    """
+    Context of a block loaded from a BBStore record. Its features are
+    decoded from the record mapping on first access
+    """
+    def __init__(self, rec, i, icount, flags):
+        # The features are left unset so __getattr__() loads them
+        self.inst_count = icount
+        self._rec = rec
+        self._i = i
+        self._flags = flags
+
+
+    def __getattr__(self, name):
+        # Only called for the attributes that are not set yet
+        loader = _STORED_FEATURES.get(name)
+        if loader is None:
+            raise AttributeError(name)
+
+        value = loader(self)
+        setattr(self, name, value)
+        return value
+
+
+    def __getstate__(self):
+        """Decode all the features before pickling: the record cannot be pickled"""
+        for name in _STORED_FEATURES:
+            getattr(self, name)
+
+        d = dict(self.__dict__)
+        for name in ('_rec', '_i', '_flags'):
+            del d[name]
+        return d
 
 
 # ------------------------------------------------------------------------------
@@ -287,18 +566,27 @@ class IDABBMan(BBMan):
             bb, 
             get_bytes, 
             get_hash_itype1,
-            get_hash_itype2):
-        """Add a basic block to the manager with its context computed"""
+            get_hash_itype2,
+            stored = None):
+        """
+        Add a basic block to the manager with its context computed
+        @param stored: Optional (BBStoreRecord, block index) tuple of an
+                       unchanged block whose context is reused
+        """
     
-        # Create the context object
-        ctx = IdaBBContext()
-
-        # Compute context
-        ctx.get_context(
-             bb, 
-             get_bytes, 
-             get_hash_itype1, 
-             get_hash_itype2)
+        if stored is not None:
+            rec, i = stored
+            ctx = IdaBBContext.FromStore(rec, i, rec.inst_count(i), rec.flags(i))
+        else:
+            # Create the context object
+            ctx = IdaBBContext()
+
+            # Compute context
+            ctx.get_context(
+                 bb, 
+                 get_bytes, 
+                 get_hash_itype1, 
+                 get_hash_itype2)
 
         # Assign context to the basic block object
         bb.ctx = ctx
@@ -313,15 +601,23 @@ class IDABBMan(BBMan):
             use_cache = False, 
             get_bytes = False, 
             get_hash_itype1 = False,
-            get_hash_itype2 = False):
+            get_hash_itype2 = False,
+            expected_digest = None):
         """
         Build a BasicBlock manager object from a function address
+        @param expected_digest: In standalone mode, the function digest the
+                                stored record must have (optional)
         """
        
-        # Use cache?
-        if use_cache:
-            # Try to load cached items
-            if self.load(_get_cache_filename(func_addr)):
+        # Use cache? In standalone mode the database cannot be read, so
+        # the record is only used if it is consistent with its block digests
+        if use_cache and stdalone:
+            err = check_stored_digest(_get_store().get(func_addr), expected_digest)
+            if err is not None:
+                return (False, "%s for %x" % (err, func_addr))
+
+            # Try to load the stored items
+            if self.load_store(_get_store(), func_addr, IdaBBContext.FromStore):
                 # Loaded successfully, return to caller...
                 return (True, self)
 
@@ -337,63 +633,67 @@ class IDABBMan(BBMan):
         # Update function address to point to the start of the function
         func_addr = fnc.startEA
 
-        # Main IDA BB loop
-        fc = idaapi.FlowChart(fnc)
+        # The predecessors are only listed when asked for
+        fc = idaapi.FlowChart(fnc, flags = idaapi.FC_PREDS)
+
+        # Features the stored blocks must have to be reused
+        needed = BBF_INSNS
+        if get_bytes:
+            needed |= BBF_BYTES
+        if get_hash_itype1:
+            needed |= BBF_HASH1
+        if get_hash_itype2:
+            needed |= BBF_HASH2
+
+        rec = None
+        reusable = {}
+        digests = {}
+        if use_cache:
+            # Stamp the blocks with their content digests
+            for block in fc:
+                digests[block.id] = block_digest(block.startEA, block.endEA)
+            digest = function_digest(digests)
+
+            rec = _get_store().get(func_addr)
+            if rec is not None:
+                reusable = rec.digest_index()
+
+                # Unchanged function: load the stored items
+                if (rec.digest == digest
+                        and all((rec.flags(i) & needed) == needed for i in xrange(rec.count))
+                        and self.load_store(_get_store(), func_addr, IdaBBContext.FromStore)):
+                    return (True, self)
+
+        def get_stored(block):
+            """Return the stored context of an unchanged block or None"""
+            i = reusable.get(digests.get(block.id))
+            if i is None or (rec.flags(i) & needed) != needed:
+                return None
+            return (rec, i)
+
+        # Create all the blocks
+        for block in fc:
+            bb = BBDef(id=block.id, 
+                       start=block.startEA, 
+                       end=block.endEA)
+
+            self.add_bb_ctx(
+                    bb, 
+                    get_bytes, 
+                    get_hash_itype1,
+                    get_hash_itype2,
+                    get_stored(block))
+
+        # Link them in one pass. The flowchart can list an edge more than once
         for block in fc:
-            # Try to get BB reference
             bb = self[block.id]
-            if bb is None:
-                bb = BBDef(id=block.id, 
-                           start=block.startEA, 
-                           end=block.endEA)
-                
-                # Add the current block
-                self.add_bb_ctx(
-                        bb, 
-                        get_bytes, 
-                        get_hash_itype1,
-                        get_hash_itype2)
-
-            # Add all successors
-            for succ_block in block.succs():
-                # Is the successor block already present?
-                b0 = self[succ_block.id]
-                if b0 is None:
-                    b0 = BBDef(id=succ_block.id, 
-                               start=succ_block.startEA, 
-                               end=succ_block.endEA)
-
-                    # Add successor
-                    self.add_bb_ctx(
-                            b0, 
-                            get_bytes, 
-                            get_hash_itype1, 
-                            get_hash_itype2)
-
-                # Link successor
-                bb.add_succ(b0, link_pred = True)
-                    
-            # Add all predecessors
-            for pred_block in block.preds():
-                # Is the successor block already present?
-                b0 = self[pred_block.id]
-                if b0 is None:
-                    b0 = BBDef(id=pred_block.id, 
-                               start=pred_block.startEA, 
-                               end=pred_block.endEA)
-                    # Add predecessor
-                    self.add_bb_ctx(
-                            b0, 
-                            get_bytes, 
-                            get_hash_itype1,
-                            get_hash_itype2)
-
-                # Link predecessor
-                bb.add_pred(b0, link_succ = True)
+            bb.succs = unique_block_ids(block.succs())
+            bb.preds = unique_block_ids(block.preds())
+        self.links_changed()
 
         # Save nodes if cache is enabled
         if use_cache:
-            self.save(_get_cache_filename(func_addr))
+            self.save_store(_get_store(), func_addr, digest, digests)
 
         return (True, self)
 
@@ -436,6 +736,10 @@ _OP_P_OFFS    = _MAX_PRIMES - (UA_MAXOP * (o_last+1))
 # Precompute primes
 _CachedPrimes = bb_utils.CachedPrimes(_MAX_PRIMES)
 
+# Precompute the hash_itype2() key pairs. They use the primes pool indices
+_KEY_MASK   = (1 << 64) - 1
+_CachedKeys = [(bb_utils.Mix64(i), bb_utils.Mix64(i | (1 << 32))) for i in xrange(_MAX_PRIMES)]
+
 # ------------------------------------------------------------------------------
 if __name__ == '__main__':
     ft1 = (7, {21614129: 5, 4790013691321L: 1, 722682555311L: 1})
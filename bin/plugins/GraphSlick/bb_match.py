@@ -45,6 +45,9 @@ class bbMatcherClass:
 		self.G=None
 		self.address=None
 		self.nodeHashes = defaultdict(dict)
+		self.pathIndex = defaultdict(dict)
+		self.headPathIndex = defaultdict(list)
+		self.succIndex = {}
 		self.bm=None
 		if func_addr!=None:
 			self.buildGRaphFromFunc(func_addr)
@@ -64,8 +67,8 @@ class bbMatcherClass:
 	def match(self,N1,N2, hashType):
 		"""Matches two nodes based on their type1(ordered instruction type hash) hash"""
 		if (hashType == 'freq'):
-			f1 = get_block_frequency(N1.start, N1.end)
-			f2 = get_block_frequency(N2.start, N2.end)
+			f1 = get_bb_frequency(N1)
+			f2 = get_bb_frequency(N2)
 			a, d1 = f1
 			b, d2 = f2
 
@@ -80,7 +83,9 @@ class bbMatcherClass:
 			
 			b1, b2 = match_block_frequencies(f1, f2, coveragePercentage, 95)
 			if (b1 and b2):
-				intersection = set.intersection(set(d1.keys()), set(d2.keys()))
+				# Sort the common characteristics so the label does not depend
+				# on the set iteration order
+				intersection = sorted(set.intersection(set(d1.keys()), set(d2.keys())))
 				freqHash = hashlib.sha1()
 				freqHash.update(intersection.__str__())
 				hash = freqHash.hexdigest()
@@ -93,6 +98,22 @@ class bbMatcherClass:
 		
 	def hashBBMatch(self, hashType):
 		"""Creates a dictionary of basic blocks with the hash as the key and matching block numbers as items of a list for that entry"""
+		if hashType != 'freq':
+			# Exact hashes: bucket the blocks in one pass
+			buckets = {}
+			hashes = self.G.graph().column(hashType)
+			for i in range(0,len(self.G.items())):
+				buckets.setdefault(hashes[i], []).append(i)
+			for x, nodes in buckets.iteritems():
+				if len(nodes) < 2:
+					continue
+				if self.M.has_key(x):
+					self.M[x] += [j for j in nodes if j not in self.M[x]]
+				else:
+					self.M[x] = nodes
+			return
+
+		# The fuzzy frequency match is not transitive: compare all the pairs
 		for i in range(0,len(self.G.items())):
 			for j in range (i+1,len(self.G.items())):
 				if self.match(self.G[i],self.G[j],hashType):
@@ -105,49 +126,112 @@ class bbMatcherClass:
 						self.M[x]=[i,j]
 
 	def makeSubgraphSingleEntryPoint(self,path1, path2):
+		"""Remove nodes from the tail of both paths until no node other than the head has a predecessor outside of the remaining nodes"""
 		if (len(path1) != len(path2)):
-			quit()
+			return OrderedSet(), OrderedSet()
 	
+		G = self.G.graph()
 		tmp_path1 = list(path1)
 		tmp_path2 = list(path2)
-		headNode = path1[0]
-		nodeRemoved = True
-		while nodeRemoved:
-			nodeRemoved = False
-			for node in tmp_path1:
-				for pred in self.G[node].preds:
-					if not (pred in tmp_path1) and node != headNode:
-						nodeRemoved = True
-						break
-			if (nodeRemoved):
-				try:
-					nodeIndex = tmp_path1.index(node)
-					tmp_path1.remove(node)
-					tmp_path2.remove( tmp_path2[nodeIndex] )
-				except:
-					quit()
-
-		return OrderedSet(tmp_path1), OrderedSet(tmp_path2)
+		pathIndex = dict((node, i) for i, node in enumerate(tmp_path1))
+
+		# count the predecessors outside of the path of each node
+		externalPreds = [0] * len(tmp_path1)
+		unclosed = 0
+		for i in range(1, len(tmp_path1)):
+			for pred in G.preds(tmp_path1[i]):
+				if not pathIndex.has_key(pred):
+					externalPreds[i] += 1
+			if externalPreds[i] > 0:
+				unclosed += 1
+
+		# removing the tail node makes it an external predecessor of its successors that remain in the path
+		pathLen = len(tmp_path1)
+		while unclosed > 0 and pathLen > 1:
+			pathLen -= 1
+			if externalPreds[pathLen] > 0:
+				unclosed -= 1
+			for succ in G.succs(tmp_path1[pathLen]):
+				i = pathIndex.get(succ, -1)
+				if 0 < i < pathLen:
+					externalPreds[i] += 1
+					if externalPreds[i] == 1:
+						unclosed += 1
+
+		return OrderedSet(tmp_path1[:pathLen]), OrderedSet(tmp_path2[:pathLen])
 		
+	def buildSuccIndex(self):
+		"""Index the successors of each block by hash for findMatchInSuccs
+		succIndex: hash type -> node -> {hash: positions of the successors with that hash}
+		"""
+		self.succIndex = {}
+		G = self.G.graph()
+		for hashType in ['hash_itype1', 'hash_itype2']:
+			index = {}
+			hashes = G.column(hashType)
+			for n in self.G.items():
+				byHash = defaultdict(list)
+				for pos, s in enumerate(G.succs(n.id)):
+					byHash[hashes[s]].append(pos)
+				index[n.id] = byHash
+			self.succIndex[hashType] = index
+
 	def findMatchInSuccs(self, node1, Parent2, hashType, visitedNodes2, tmpVisitedNodes2, path2):
-		matchedbyHash = False
-		for m in self.G[Parent2].succs:
-			if (m not in visitedNodes2) and (m !=Parent2) and (m not in path2):
-				tmpVisitedNodes2.add(m)
-				if (self.match(self.G[node1], self.G[m], hashType)):
-					if node1==m:
-						continue
-					matchedbyHash = True
+		"""Find the first successor of Parent2 that matches node1
+		Every successor compared with node1 is added to tmpVisitedNodes2. The exact hashes only compare the successors with the same hash
+		"""
+		G = self.G.graph()
+		succs = G.succs(Parent2)
+		m = None
+		matchPos = None
+		if hashType != 'freq':
+			for pos in self.succIndex[hashType][Parent2].get(G.column(hashType)[node1], []):
+				m = succs[pos]
+				if (m not in visitedNodes2) and (m !=Parent2) and (m not in path2) and (m != node1):
+					matchPos = pos
 					break
-		return matchedbyHash, m, tmpVisitedNodes2
+		else:
+			for pos, m in enumerate(succs):
+				if (m not in visitedNodes2) and (m !=Parent2) and (m not in path2) and (m != node1):
+					if (self.match(self.G[node1], self.G[m], hashType)):
+						matchPos = pos
+						break
+
+		# The successors up to the match (or all of them) were compared
+		if matchPos is None:
+			scanned = succs
+		else:
+			scanned = succs[:matchPos + 1]
+		for s in scanned:
+			if (s not in visitedNodes2) and (s !=Parent2) and (s not in path2):
+				tmpVisitedNodes2.add(s)
+
+		if matchPos is None:
+			return False, None, tmpVisitedNodes2
+		m = succs[matchPos]
+		return True, m, tmpVisitedNodes2
 	
 
+	def addPathPair(self, paths, pathSet, path1, path2):
+		"""Append the two paths to the list if they are not listed yet.
+		pathSet holds the tuples of the listed paths: a lookup hashes the path and only compares it to the listed paths with the same hash
+		"""
+		for path in (path1, path2):
+			key = tuple(path)
+			if key not in pathSet:
+				pathSet.add(key)
+				paths.append(list(path))
+
 	def findSubGraphs(self):
 		"""Find equivalent path from two equivalent nodes
 		For each node hash it gets all of the BB and try to build path from each pair of them
 		The result is put in a dual dictionary that has the starting node hash as the first key, the path hash as the second key and the equivalent pathS as a list of sets(containing nodes) 
 		"""
 		matchedPathsWithDifferentLengths = 0
+		# (node hash, path hash) -> tuples of the paths already listed
+		pathSet = defaultdict(set)
+		pathSetFull = defaultdict(set)
+		G = self.G.graph()
 		for i in self.M.keys():
 			for z in range(0,len(self.M[i])-1):
 				for j in self.M[i][z+1:]:							#pick one from the second node onward
@@ -164,12 +248,12 @@ class bbMatcherClass:
 					path2.add(j)
 					path1Str=''
 					path2Str=''
-					path1NodeHashes[self.M[i][z]]=self.G[(self.M[i][z])].ctx.hash_itype2
+					path1NodeHashes[self.M[i][z]]=G.column('hash_itype2')[self.M[i][z]]
 					pathHash1= hashlib.sha1()
 					while not q1.empty():			                            # for each matching pair from tmp
 						x,y = q1.get(block = False)
 						tmp_visited2=set()
-						for l in self.G[x].succs :						
+						for l in G.succs(x) :						
 							matchedbyHash = False
 							if (l not in visited1) and (l !=x) and (l not in path1):
 								visited1.add(l)
@@ -209,22 +293,7 @@ class bbMatcherClass:
 						if not(self.pathPerNodeHashFull.has_key(i)) or (not( self.pathPerNodeHashFull[i].has_key(a))):
 							self.pathPerNodeHashFull[i][a]=[]
 
-						duplicate1 = False
-						duplicate2 = False
-					
-						listPath1 = list(path1)
-						listPath2 = list(path2)
-						
-						for zz in self.pathPerNodeHashFull[i][a]:
-							if listPath1 == zz:
-								duplicate1 = True
-							if listPath2 == zz:
-								duplicate2 = True
-								
-						if not duplicate1:
-							self.pathPerNodeHashFull[i][a].append(list(listPath1))
-						if not duplicate2:
-							self.pathPerNodeHashFull[i][a].append(list(listPath2))
+						self.addPathPair(self.pathPerNodeHashFull[i][a], pathSetFull[(i, a)], path1, path2)
 
 					if len(path1_bis) >1:
 						path1Str = ''
@@ -236,22 +305,7 @@ class bbMatcherClass:
 						if not(self.pathPerNodeHash.has_key(i)) or (not( self.pathPerNodeHash[i].has_key(a))):
 							self.pathPerNodeHash[i][a]=[]
 
-						duplicate1 = False
-						duplicate2 = False
-					
-						listPath1 = list(path1_bis)
-						listPath2 = list(path2_bis)
-						
-						for zz in self.pathPerNodeHash[i][a]:
-							if listPath1 == zz:
-								duplicate1 = True
-							if listPath2 == zz:
-								duplicate2 = True
-								
-						if not duplicate1:
-							self.pathPerNodeHash[i][a].append(list(listPath1))
-						if not duplicate2:
-							self.pathPerNodeHash[i][a].append(list(listPath2))					
+						self.addPathPair(self.pathPerNodeHash[i][a], pathSet[(i, a)], path1_bis, path2_bis)
 		
 	def sortByPathLen(self):
 		"""It gets the structure created by findSubGraph and creates a dictionary with the path len as the key and the tupple of node hash and path hash as the entry"""
@@ -265,14 +319,24 @@ class bbMatcherClass:
 				
 		self.sorted_keys=sorted(self.size_dic.keys())
 
-	def subgraphHasExternalJumpsIntoIt(self,subgraph):
+	def nodeMask(self, nodes):
+		"""Return the bitmask of a node list: bit n is set for the node n"""
+		mask = 0
+		for n in nodes:
+			mask |= 1 << n
+		return mask
+
+	def subgraphHasExternalJumpsIntoIt(self,subgraph, subgraphMask = None):
+		if subgraphMask == None:
+			subgraphMask = self.nodeMask(subgraph)
 		for node in list(subgraph)[1:] :
-			if not set(self.G[node].preds).issubset(set(subgraph)):
+			if self.nodeMask(self.G.graph().preds(node)) & ~subgraphMask:
 				return True
 		return False
 		
 	def GetMatchedWellFormedFunctions(self, minFunctionSizeInBlocks = 4, minFunctionHeadSize = 0):
-		MovedSubgraph = []
+		# node -> bitmasks of the moved subgraphs that contain it
+		MovedSubgraphMasks = defaultdict(list)
 		for i in reversed(sorted(self.size_dic.keys())):
 			if i < minFunctionSizeInBlocks :
 				break
@@ -284,65 +348,94 @@ class bbMatcherClass:
 				if (not self.normalizedPathPerNodeHash[x].has_key(y)):
 					self.normalizedPathPerNodeHash[x][y] = []
 
-				if self.subgraphHasExternalJumpsIntoIt( self.pathPerNodeHash[x][y][0]):
+				masks = [self.nodeMask(j) for j in self.pathPerNodeHash[x][y]]
+				if self.subgraphHasExternalJumpsIntoIt( self.pathPerNodeHash[x][y][0], masks[0]):
 					continue
-				for j in self.pathPerNodeHash[x][y]:
+				normalizedMasks = []
+				for j, jMask in zip(self.pathPerNodeHash[x][y], masks):
+					# a moved subgraph that covers j contains its first node
 					skip=False
-					for k in MovedSubgraph:
-						if set(j).issubset(set(k)):
+					for k in MovedSubgraphMasks[j[0]]:
+						if not (jMask & ~k):
 							skip=True
 							break
 					if not skip:
 						self.normalizedPathPerNodeHash[x][y].append(j)
+						normalizedMasks.append(jMask)
 
 				if len(self.normalizedPathPerNodeHash[x][y]) < 2 :
 					self.normalizedPathPerNodeHash[x][y] = [] 
 				else:
 					if ( minFunctionHeadSize > 0 ):
 						subgraphStartAddress = self.G[ self.normalizedPathPerNodeHash[x][y][0][0] ].start
-						functionHeadBigEnough = True
-						for address in range ( subgraphStartAddress, subgraphStartAddress + 8, 2 ):
-							if not AddressIsInSubgraph( address, self.normalizedPathPerNodeHash[x][y][0] ):
-								functionHeadBigEnough = False
-								break
-						if not functionHeadBigEnough:
+						addresses = range ( subgraphStartAddress, subgraphStartAddress + 8, 2 )
+						if not self.AddressesAreInSubgraph( addresses, self.normalizedPathPerNodeHash[x][y][0] ):
 							self.normalizedPathPerNodeHash[x][y] = [] 
 							
-				MovedSubgraph.extend( self.normalizedPathPerNodeHash[x][y] )
+				for j, jMask in zip(self.normalizedPathPerNodeHash[x][y], normalizedMasks):
+					for n in j:
+						MovedSubgraphMasks[n].append(jMask)
 
 	def AddressIsInSubgraph(self, address, subgraph) :
-		for i in subgraph :
-			if (self.G[i].start <= address < self.G[i].end) :
-				return True
-		return False
+		bb = self.G.find_by_addr(address)
+		return bb is not None and bb.id in subgraph
+
+	def AddressesAreInSubgraph(self, addresses, subgraph) :
+		subgraph = set(subgraph)
+		for bb in self.G.find_many_by_addr(addresses) :
+			if bb is None or bb.id not in subgraph :
+				return False
+		return True
 	
+	def buildSimilarIndex(self):
+		"""Index the paths of pathPerNodeHashFull for FindSimilar
+		pathIndex: node -> {(node hash, subgraph hash, path index): position of the node in the path}
+		headPathIndex: node -> keys of the paths starting with the node
+		"""
+		self.pathIndex = defaultdict(dict)
+		self.headPathIndex = defaultdict(list)
+		for nodeHash in self.pathPerNodeHashFull:
+			for subgraphHash in self.pathPerNodeHashFull[nodeHash]:
+				for i, path in enumerate(self.pathPerNodeHashFull[nodeHash][subgraphHash]):
+					key = (nodeHash, subgraphHash, i)
+					self.headPathIndex[path[0]].append(key)
+					for pos, node in enumerate(path):
+						self.pathIndex[node][key] = pos
+
 	def FindSimilar(self, nodeList, hashType = 'hash_itype2' ):
 		size = len(nodeList)
 		headNode = nodeList[0]
-		setNodeList = set( nodeList )
 
 		result = []
+		found = set()
 		
 		if ( size == 1 ):
-			return self.M[ self.nodeHashes[headNode][hashType] ]
+			return [[node] for node in self.M.get(self.nodeHashes[headNode][hashType], [])]
 		
 		for headNode in nodeList:
-			headNodeHash = self.nodeHashes[headNode][hashType]
-			for subgraphHash in self.pathPerNodeHashFull[headNodeHash]:
+			done = set()
+			for key in self.headPathIndex.get(headNode, []):
+				headNodeHash, subgraphHash, i = key
+				# only the first path of a subgraph that contains all the nodes is used
+				if subgraphHash in done:
+					continue
 				if size <= len(self.pathPerNodeHashFull[headNodeHash][subgraphHash][0]):
-					for match in self.pathPerNodeHashFull[headNodeHash][subgraphHash]:
-						if headNode == match[0] and setNodeList.issubset(set(match)):
-							# get the subsets from each path that matches the input node list
-							matchIndex = {}
-							for node in nodeList:
-								matchIndex[node] = match.index(node)
-							for matchedSubgraph in self.pathPerNodeHashFull[headNodeHash][subgraphHash]:
-								subset = []
-								for node in nodeList:
-									subset.append( matchedSubgraph[matchIndex[node]] )
-								if ( not result.__contains__( subset ) ) :
-									result.append( subset )
+					# get the position of each node in the matched path
+					matchIndex = []
+					for node in nodeList:
+						pos = self.pathIndex.get(node, {}).get(key)
+						if pos == None:
 							break
+						matchIndex.append(pos)
+					if len(matchIndex) != size:
+						continue
+					done.add(subgraphHash)
+					# get the subsets from each path that matches the input node list
+					for matchedSubgraph in self.pathPerNodeHashFull[headNodeHash][subgraphHash]:
+						subset = tuple(matchedSubgraph[pos] for pos in matchIndex)
+						if subset not in found:
+							found.add(subset)
+							result.append(list(subset))
 			if len(result) > 0:
 				return result
 		return []
@@ -357,13 +450,11 @@ class bbMatcherClass:
 			reducedPathPerNodeHash[x] = {}
 			for y in self.normalizedPathPerNodeHash[x]:
 				reducedPathPerNodeHash[x][y] = []
+				serialized = set()
 				for i in range(0, len(self.normalizedPathPerNodeHash[x][y])):
-					duplicate = False
-					for j in reducedPathPerNodeHash[x][y]:
-						if self.normalizedPathPerNodeHash[x][y][i].__str__() == j.__str__():
-							duplicate = True
-							break
-					if not duplicate:
+					key = self.normalizedPathPerNodeHash[x][y][i].__str__()
+					if key not in serialized:
+						serialized.add(key)
 						reducedPathPerNodeHash[x][y].append( self.normalizedPathPerNodeHash[x][y][i] )
 
 
@@ -456,6 +547,7 @@ class bbMatcherClass:
 			elif segment.startswith( bbMatcherClass.NodeHashMatchesMarker ):
 				self.M = pickle.loads(segment[len( bbMatcherClass.NodeHashMatchesMarker):] )
 
+		self.buildSimilarIndex()
 		f.close()
 		
 	def Analyze(self,func_addr=None):
@@ -465,10 +557,13 @@ class bbMatcherClass:
 		if self.G !=None:
 		# todo: refactor this to get the list from one place
 			for hashName in ['hash_itype1', 'hash_itype2']:
+				hashes = self.G.graph().column(hashName)
 				for i in self.G.items():
-					self.nodeHashes[i.id][hashName] = self.G[i.id][hashName]
+					self.nodeHashes[i.id][hashName] = hashes[i.id]
+			self.buildSuccIndex()
 			self.hashBBMatch('hash_itype2')
 			self.findSubGraphs()
+			self.buildSimilarIndex()
 			self.sortByPathLen()
 			self.GetMatchedWellFormedFunctions()
 		 
@@ -0,0 +1,565 @@
+"""
+Basic block store module
+
+A single memory-mapped file holding the basic blocks of many functions.
+It replaces the per function pickle caches: each function is one record
+of columnar arrays (block bounds, edges and features, including the
+instruction frequency tables) that is read in place from the mapping.
+A mapping stays alive as long as records read from it are referenced,
+so the contexts loaded from a record can decode their features lazily.
+
+File layout (little endian):
+
+    header      magic, version, function count, directory offset
+    records     one per saved function, appended
+    directory   (function address, record offset, record size, record CRC32)
+                per function
+
+Saving a function appends its record and a new directory, then points the
+header to that directory. Until the header is rewritten the previous
+directory is still valid, so an interrupted save leaves the store as it
+was. The space of the replaced records and directories is reclaimed by
+compact(), which writes a new file and renames it over the store.
+
+Each record is stamped with a digest of the function and of each of its
+blocks (see bb_ida.block_digest()) so stale records can be detected and
+their unchanged blocks reused.
+
+A record whose CRC32 does not match, or whose columns and offsets do not
+fit in it, is treated as missing. A bad header makes the store start over.
+
+"""
+
+import os
+import mmap
+import zlib
+import struct
+import binascii
+
+# ------------------------------------------------------------------------------
+STORE_MAGIC   = 'GSBS'
+STORE_VERSION = 4
+
+_HDR_FMT  = '<4sIIQ'
+_HDR_SIZE = struct.calcsize(_HDR_FMT)
+_DIR_FMT  = '<QQQI'
+_DIR_SIZE = struct.calcsize(_DIR_FMT)
+_REC_FMT  = '<8I20s'
+_REC_SIZE = struct.calcsize(_REC_FMT)
+
+# Raw digest sizes of the hash_itype1 and hash_itype2 hex strings
+_H1_SIZE  = 20
+_H2_SIZE  = 16
+
+# Size of the function and block content digests
+DIGEST_SIZE = 20
+
+# Per block flags telling which features are present
+BBF_HASH1 = 0x01
+BBF_HASH2 = 0x02
+BBF_BYTES = 0x04
+BBF_INSNS = 0x08
+BBF_FREQ  = 0x10
+
+# ------------------------------------------------------------------------------
+def _pack_offsets(lists):
+    """Return the offsets column and the concatenation of a list of lists"""
+    offs = [0]
+    flat = []
+    for l in lists:
+        flat.extend(l)
+        offs.append(len(flat))
+    return (offs, flat)
+
+
+# ------------------------------------------------------------------------------
+def _pack_int(v):
+    """Return the big endian bytes of a non negative integer of any size"""
+    h = '%x' % v
+    if len(h) & 1:
+        h = '0' + h
+    return binascii.unhexlify(h)
+
+
+# ------------------------------------------------------------------------------
+def _pack_digest(h, size):
+    """Return the raw digest of a hex string hash or zeros if it is None"""
+    if h is None:
+        return '\0' * size
+    return binascii.unhexlify(h)
+
+
+# ------------------------------------------------------------------------------
+def _replace_file(src, dst):
+    """Rename a file over another one"""
+    # Windows does not rename over an existing file. The store is a cache:
+    # losing it if the rename fails only costs a recomputation
+    if os.name == 'nt' and os.path.exists(dst):
+        os.remove(dst)
+    os.rename(src, dst)
+
+
+# ------------------------------------------------------------------------------
+class BBStoreRecord(object):
+    """
+    View over the record of one function in the store mapping.
+    The columns are decoded from the mapping on access. The constructor
+    raises ValueError if the record does not fit in its 'size' bytes or if
+    its offsets and edges are not consistent
+    """
+    def __init__(self, mm, offset, size):
+        self.mm = mm
+        if size < _REC_SIZE or offset + size > len(mm):
+            raise ValueError("Truncated record")
+
+        (self.count,
+         self.nsuccs,
+         self.npreds,
+         self.nbytes,
+         self.ninsns,
+         self.nops,
+         self.nfreq,
+         self.nfkey,
+         self.digest) = struct.unpack_from(_REC_FMT, mm, offset)
+
+        # Compute the columns offsets
+        n = self.count
+        off = offset + _REC_SIZE
+        self.__cols = {}
+        for name, fmt, cnt in (
+                ('id',       'i', n),
+                ('start',    'Q', n),
+                ('end',      'Q', n),
+                ('icount',   'I', n),
+                ('flags',    'B', n),
+                ('digest',   's', n * DIGEST_SIZE),
+                ('hash1',    's', n * _H1_SIZE),
+                ('hash2',    's', n * _H2_SIZE),
+                ('succ_off', 'I', n + 1),
+                ('succ',     'i', self.nsuccs),
+                ('pred_off', 'I', n + 1),
+                ('pred',     'i', self.npreds),
+                ('byte_off', 'I', n + 1),
+                ('bytes',    's', self.nbytes),
+                ('insn_off', 'I', n + 1),
+                ('itype',    'I', self.ninsns),
+                ('op_off',   'I', self.ninsns + 1),
+                ('op',       'I', self.nops),
+                ('freq_off', 'I', n + 1),
+                ('fcount',   'I', self.nfreq),
+                ('fkey_off', 'I', self.nfreq + 1),
+                ('fkey',     's', self.nfkey)):
+            self.__cols[name] = (off, fmt, cnt)
+            off += struct.calcsize('<%d%s' % (cnt, fmt))
+
+        if off > offset + size:
+            raise ValueError("Record columns past the end of the record")
+
+        self.__check()
+
+
+    def __check(self):
+        """Check that the offset columns stay in their target columns and that the edges link known blocks"""
+        for offs, target in (
+                ('succ_off', 'succ'),
+                ('pred_off', 'pred'),
+                ('byte_off', 'bytes'),
+                ('insn_off', 'itype'),
+                ('op_off',   'op'),
+                ('freq_off', 'fcount'),
+                ('fkey_off', 'fkey')):
+            col = self.column(offs)
+            if col[0] != 0 or col[-1] != self.__cols[target][2]:
+                raise ValueError("Bad %s column" % offs)
+            for i in xrange(len(col) - 1):
+                if col[i] > col[i + 1]:
+                    raise ValueError("Bad %s column" % offs)
+
+        ids = set(self.column('id'))
+        for name in ('succ', 'pred'):
+            for id in self.column(name):
+                if id not in ids:
+                    raise ValueError("Edge to an unknown block")
+
+
+    def column(self, name):
+        """Return a whole column as a tuple (or a string for raw columns)"""
+        off, fmt, cnt = self.__cols[name]
+        if fmt == 's':
+            return self.mm[off:off + cnt]
+        return struct.unpack_from('<%d%s' % (cnt, fmt), self.mm, off)
+
+
+    def _range(self, name, first, last):
+        off, fmt, cnt = self.__cols[name]
+        if fmt == 's':
+            return self.mm[off + first:off + last]
+        sz = struct.calcsize('<' + fmt)
+        return struct.unpack_from('<%d%s' % (last - first, fmt), self.mm, off + first * sz)
+
+
+    def blocks(self):
+        """
+        Yield the blocks as (id, start, end, instruction count, flags) tuples
+        """
+        ids    = self.column('id')
+        starts = self.column('start')
+        ends   = self.column('end')
+        icount = self.column('icount')
+        flags  = self.column('flags')
+        for i in xrange(self.count):
+            yield (ids[i], starts[i], ends[i], icount[i], flags[i])
+
+
+    def inst_count(self, i):
+        """Return the instruction count of the i-th block"""
+        return self._range('icount', i, i + 1)[0]
+
+
+    def flags(self, i):
+        """Return the features flags of the i-th block"""
+        return self._range('flags', i, i + 1)[0]
+
+
+    def digest_index(self):
+        """Return a dictionary: block digest -> block index"""
+        d = self.column('digest')
+        return dict((d[i * DIGEST_SIZE:(i + 1) * DIGEST_SIZE], i) for i in xrange(self.count))
+
+
+    def block_digests(self):
+        """Return a dictionary: block id -> block digest, as saved"""
+        ids = self.column('id')
+        d = self.column('digest')
+        return dict((ids[i], d[i * DIGEST_SIZE:(i + 1) * DIGEST_SIZE]) for i in xrange(self.count))
+
+
+    def succs(self, i):
+        """Return the successor ids of the i-th block"""
+        a, b = self._range('succ_off', i, i + 2)
+        return list(self._range('succ', a, b))
+
+
+    def preds(self, i):
+        """Return the predecessor ids of the i-th block"""
+        a, b = self._range('pred_off', i, i + 2)
+        return list(self._range('pred', a, b))
+
+
+    def hash_itype1(self, i):
+        return binascii.hexlify(self._range('hash1', i * _H1_SIZE, (i + 1) * _H1_SIZE))
+
+
+    def hash_itype2(self, i):
+        return binascii.hexlify(self._range('hash2', i * _H2_SIZE, (i + 1) * _H2_SIZE))
+
+
+    def bytes(self, i):
+        a, b = self._range('byte_off', i, i + 2)
+        return self._range('bytes', a, b)
+
+
+    def insns(self, i):
+        """Return the decoded instructions of the i-th block"""
+        a, b = self._range('insn_off', i, i + 2)
+        itypes = self._range('itype', a, b)
+        op_offs = self._range('op_off', a, b + 1)
+        ops = self._range('op', op_offs[0], op_offs[-1])
+        base = op_offs[0]
+        return [(itypes[k], tuple(ops[op_offs[k] - base:op_offs[k + 1] - base]))
+                for k in xrange(b - a)]
+
+
+    def freq_table(self, i):
+        """Return the frequency table of the i-th block: (total, {characteristic: count})"""
+        a, b = self._range('freq_off', i, i + 2)
+        counts = self._range('fcount', a, b)
+        key_offs = self._range('fkey_off', a, b + 1)
+        keys = self._range('fkey', key_offs[0], key_offs[-1])
+        base = key_offs[0]
+        d = {}
+        for k in xrange(b - a):
+            key = keys[key_offs[k] - base:key_offs[k + 1] - base]
+            d[int(binascii.hexlify(key), 16)] = counts[k]
+        return (sum(counts), d)
+
+
+# ------------------------------------------------------------------------------
+def pack_record(blocks, digest, block_digests):
+    """
+    Serialize the blocks of a function to a record.
+    @param blocks: List of BBDef objects. Their ctx may hold the hash_itype1,
+                   hash_itype2, inst_count, bytes, insns and freq_table features
+    @param digest: The content digest of the function
+    @param block_digests: Dictionary: block id -> content digest
+    """
+    n = len(blocks)
+    ids, starts, ends, icount, flags = [], [], [], [], []
+    h1, h2, raw, insns, freqs = [], [], [], [], []
+    for bb in blocks:
+        ctx = bb.ctx
+        f = 0
+        ids.append(bb.id)
+        starts.append(bb.start)
+        ends.append(bb.end)
+        icount.append(getattr(ctx, 'inst_count', 0) or 0)
+
+        h = getattr(ctx, 'hash_itype1', None)
+        if h is not None:
+            f |= BBF_HASH1
+        h1.append(_pack_digest(h, _H1_SIZE))
+
+        h = getattr(ctx, 'hash_itype2', None)
+        if h is not None:
+            f |= BBF_HASH2
+        h2.append(_pack_digest(h, _H2_SIZE))
+
+        b = getattr(ctx, 'bytes', None)
+        if b is not None:
+            f |= BBF_BYTES
+        raw.append(b or '')
+
+        l = getattr(ctx, 'insns', None)
+        if l is not None:
+            f |= BBF_INSNS
+        insns.append(l or [])
+
+        ft = getattr(ctx, 'freq_table', None)
+        if ft is not None:
+            f |= BBF_FREQ
+            freqs.append(sorted(ft[1].items()))
+        else:
+            freqs.append([])
+
+        flags.append(f)
+
+    succ_off, succ = _pack_offsets([bb.succs for bb in blocks])
+    pred_off, pred = _pack_offsets([bb.preds for bb in blocks])
+
+    byte_off = [0]
+    for b in raw:
+        byte_off.append(byte_off[-1] + len(b))
+
+    insn_off, flat_insns = _pack_offsets(insns)
+    itypes = [insn[0] for insn in flat_insns]
+    op_off, ops = _pack_offsets([insn[1] for insn in flat_insns])
+
+    freq_off, flat_freqs = _pack_offsets(freqs)
+    fcount = [count for key, count in flat_freqs]
+    fkeys = [_pack_int(key) for key, count in flat_freqs]
+    fkey_off = [0]
+    for k in fkeys:
+        fkey_off.append(fkey_off[-1] + len(k))
+
+    parts = [
+        struct.pack(_REC_FMT, n, len(succ), len(pred), byte_off[-1], len(itypes), len(ops),
+                    len(fcount), fkey_off[-1], digest),
+        struct.pack('<%di' % n, *ids),
+        struct.pack('<%dQ' % n, *starts),
+        struct.pack('<%dQ' % n, *ends),
+        struct.pack('<%dI' % n, *icount),
+        struct.pack('<%dB' % n, *flags),
+        ''.join([block_digests.get(bb.id, '\0' * DIGEST_SIZE) for bb in blocks]),
+        ''.join(h1),
+        ''.join(h2),
+        struct.pack('<%dI' % (n + 1), *succ_off),
+        struct.pack('<%di' % len(succ), *succ),
+        struct.pack('<%dI' % (n + 1), *pred_off),
+        struct.pack('<%di' % len(pred), *pred),
+        struct.pack('<%dI' % (n + 1), *byte_off),
+        ''.join(raw),
+        struct.pack('<%dI' % (n + 1), *insn_off),
+        struct.pack('<%dI' % len(itypes), *itypes),
+        struct.pack('<%dI' % len(op_off), *op_off),
+        struct.pack('<%dI' % len(ops), *ops),
+        struct.pack('<%dI' % (n + 1), *freq_off),
+        struct.pack('<%dI' % len(fcount), *fcount),
+        struct.pack('<%dI' % len(fkey_off), *fkey_off),
+        ''.join(fkeys)]
+
+    return ''.join(parts)
+
+
+# ------------------------------------------------------------------------------
+class BBStore(object):
+    """Store of the basic blocks of many functions in one mapped file"""
+    def __init__(self, filename):
+        self.filename = filename
+        """The store file name"""
+
+        self.__mm = None
+        self.__f = None
+        self.__dir = {}
+        self.__dir_offset = _HDR_SIZE
+
+
+    def __map(self):
+        """(Re)map the store file and read its directory"""
+        self.__unmap()
+        self.__dir = {}
+        self.__dir_offset = _HDR_SIZE
+        try:
+            self.__f = open(self.filename, 'rb')
+            self.__mm = mmap.mmap(self.__f.fileno(), 0, access=mmap.ACCESS_READ)
+        except:
+            self.__unmap()
+            return False
+
+        ok = False
+        if len(self.__mm) >= _HDR_SIZE:
+            magic, version, count, dir_offset = struct.unpack_from(_HDR_FMT, self.__mm, 0)
+            if (magic == STORE_MAGIC and version == STORE_VERSION
+                    and dir_offset >= _HDR_SIZE
+                    and dir_offset + count * _DIR_SIZE <= len(self.__mm)):
+                # The records precede their directory. A bad entry is dropped
+                # and its function is recomputed
+                for i in xrange(count):
+                    ea, off, size, crc = struct.unpack_from(_DIR_FMT, self.__mm, dir_offset + i * _DIR_SIZE)
+                    if off >= _HDR_SIZE and off + size <= dir_offset:
+                        self.__dir[ea] = (off, size, crc)
+                self.__dir_offset = dir_offset
+                ok = True
+
+        # Not a store or another version: start over when saving
+        if not ok:
+            self.__unmap()
+        return ok
+
+
+    def __unmap(self):
+        # The mapping is not closed: it is released with the last record
+        # read from it
+        self.__mm = None
+        if self.__f is not None:
+            self.__f.close()
+            self.__f = None
+
+
+    def close(self):
+        """Release the mapping"""
+        self.__unmap()
+        self.__dir = {}
+
+
+    def get(self, func_addr):
+        """Return the BBStoreRecord of a function or None if it is missing or corrupted"""
+        if self.__mm is None:
+            self.__map()
+
+        r = self.__dir.get(func_addr)
+        if r is None:
+            return None
+
+        off, size, crc = r
+        if zlib.crc32(self.__mm[off:off + size]) & 0xFFFFFFFF != crc:
+            return None
+
+        try:
+            return BBStoreRecord(self.__mm, off, size)
+        except (struct.error, ValueError):
+            return None
+
+
+    def __write_records(self, f, records):
+        """Write records and the directory at the current position, return the directory offset"""
+        for ea, rec in records:
+            self.__dir[ea] = (f.tell(), len(rec), zlib.crc32(rec) & 0xFFFFFFFF)
+            f.write(rec)
+
+        dir_offset = f.tell()
+        for ea in sorted(self.__dir):
+            off, size, crc = self.__dir[ea]
+            f.write(struct.pack(_DIR_FMT, ea, off, size, crc))
+        return dir_offset
+
+
+    def __append(self, records):
+        """
+        Append records and a new directory to the store, then point the header
+        to the new directory
+        """
+        f = open(self.filename, 'r+b')
+        try:
+            f.seek(0, os.SEEK_END)
+            dir_offset = self.__write_records(f, records)
+            f.flush()
+            os.fsync(f.fileno())
+
+            f.seek(0)
+            f.write(struct.pack(_HDR_FMT, STORE_MAGIC, STORE_VERSION, len(self.__dir), dir_offset))
+        finally:
+            f.close()
+
+
+    def __rewrite(self, records):
+        """Write a new store with the given records only and replace the store file with it"""
+        self.__dir = {}
+        tmp = self.filename + '.tmp'
+        f = open(tmp, 'wb')
+        try:
+            f.seek(_HDR_SIZE)
+            dir_offset = self.__write_records(f, records)
+            f.seek(0)
+            f.write(struct.pack(_HDR_FMT, STORE_MAGIC, STORE_VERSION, len(self.__dir), dir_offset))
+            f.flush()
+            os.fsync(f.fileno())
+            f.close()
+            _replace_file(tmp, self.filename)
+        except:
+            f.close()
+            if os.path.exists(tmp):
+                os.remove(tmp)
+            raise
+
+
+    def save(self, func_addr, blocks, digest, block_digests):
+        """
+        Save (or replace) the blocks of a function with their content digests.
+        Returns a tuple (ok, error)
+        """
+        try:
+            rec = pack_record(blocks, digest, block_digests)
+            if self.__mm is None:
+                self.__map()
+
+            # Not a store yet (or another version): start a new one
+            append = self.__mm is not None
+            self.__unmap()
+            if append:
+                self.__append([(func_addr, rec)])
+            else:
+                self.__rewrite([(func_addr, rec)])
+            self.__map()
+
+            # Reclaim the replaced records and directories once they take half the file
+            live = sum(size for off, size, crc in self.__dir.values())
+            if self.__dir_offset - _HDR_SIZE > 2 * live:
+                try:
+                    self.compact()
+                except (IOError, OSError):
+                    # The store may not be replaceable while records read
+                    # from it are alive (Windows). The save itself is done
+                    self.close()
+
+            return (True, None)
+        except Exception as e:
+            self.close()
+            return (False, str(e))
+
+
+    def compact(self):
+        """Rewrite the store with the live records only"""
+        if self.__mm is None and not self.__map():
+            return
+
+        records = [(ea, self.__mm[off:off + size]) for ea, (off, size, crc) in sorted(self.__dir.items())]
+        self.__unmap()
+        self.__rewrite(records)
+        self.__map()
+
+
+    def functions(self):
+        """Return the addresses of the stored functions"""
+        if self.__mm is None:
+            self.__map()
+        return sorted(self.__dir)
@@ -15,9 +15,15 @@ This module contains the basic types and data structures
 * 10/08/2013 - eliasb - bugfix: import from Caching
                       - added BBMan.find_by_addr()
 * 10/09/2013 - eliasb - bugfix: find_by_addr()
+                      - find_by_addr() uses a sorted address index (BBAddrIndex)
+                      - Added the compact graph view BBMan.graph() (BBGraph)
+                      - Added BBMan.links_changed() to drop the graph view after the edges change
 					  
 """
 
+import array
+import bisect
+import struct
 import pickle
 import sys
 from bb_utils import Caching
@@ -82,12 +88,118 @@ class BBDef(object):
     
     def __getitem__(self, key):
         """Shortcut method to access items in the context class"""
-        return self.ctx.__dict__[key]
+        return getattr(self.ctx, key)
 
 
     def __setitem__(self, key, value):
         """Shortcut method to set item value in the context class"""
-        self.ctx.__dict__[key] = value
+        setattr(self.ctx, key, value)
+
+
+# ------------------------------------------------------------------------------
+class BBAddrIndex(object):
+    """Sorted interval index over the basic block bounds"""
+    def __init__(self, blocks):
+        # The blocks of a function do not overlap: sort the non empty ones by start
+        blocks = sorted([bb for bb in blocks if bb.start < bb.end], key=lambda bb: bb.start)
+        self.starts = [bb.start for bb in blocks]
+        self.ends   = [bb.end for bb in blocks]
+        self.blocks = blocks
+
+
+    def find(self, addr):
+        """Return the basic block that contains the given address or None"""
+        i = bisect.bisect_right(self.starts, addr) - 1
+        if i >= 0 and addr < self.ends[i]:
+            return self.blocks[i]
+        return None
+
+
+    def find_many(self, addrs):
+        """Return the basic block (or None) that contains each given address"""
+        starts, ends, blocks = self.starts, self.ends, self.blocks
+        r = []
+        i = -1
+        for addr in addrs:
+            # Nearby addresses often fall in the same block: try the last hit first
+            if i < 0 or not (starts[i] <= addr < ends[i]):
+                i = bisect.bisect_right(starts, addr) - 1
+                if i >= 0 and addr >= ends[i]:
+                    i = -1
+            r.append(blocks[i] if i >= 0 else None)
+        return r
+
+
+# ------------------------------------------------------------------------------
+class BBGraph(object):
+    """
+    Compact struct-of-arrays view of the basic blocks of a BBMan.
+    It is indexed by block id (the flowchart ids are dense). The successors and
+    predecessors are kept in compressed sparse rows: the successors of block n
+    are succ[succ_off[n]:succ_off[n + 1]]. It is the Python counterpart of
+    the native adjlist_t. The 64-bit block bounds are split in their low and
+    high 32-bit halves since the array module has no 64-bit type code
+    """
+    COLUMNS = ('hash_itype1', 'hash_itype2')
+    """The context members kept as feature columns"""
+
+    def __init__(self, blocks):
+        blocks = dict((bb.id, bb) for bb in blocks)
+        n = max(blocks) + 1 if blocks else 0
+        self.count = n
+
+        self.start_lo   = array.array('L', [0]) * n
+        self.start_hi   = array.array('L', [0]) * n
+        self.end_lo     = array.array('L', [0]) * n
+        self.end_hi     = array.array('L', [0]) * n
+        self.inst_count = array.array('i', [0]) * n
+        self.succ_off   = array.array('i', [0]) * (n + 1)
+        self.pred_off   = array.array('i', [0]) * (n + 1)
+        self.succ       = array.array('i')
+        self.pred       = array.array('i')
+        self.columns    = dict((name, [None] * n) for name in self.COLUMNS)
+
+        for id in xrange(n):
+            bb = blocks.get(id)
+            if bb is not None:
+                self.start_lo[id] = bb.start & 0xFFFFFFFF
+                self.start_hi[id] = bb.start >> 32
+                self.end_lo[id]   = bb.end & 0xFFFFFFFF
+                self.end_hi[id]   = bb.end >> 32
+                self.succ.extend(bb.succs)
+                self.pred.extend(bb.preds)
+                ctx = bb.ctx
+                if ctx is not None:
+                    self.inst_count[id] = getattr(ctx, 'inst_count', 0)
+                    for name, col in self.columns.items():
+                        col[id] = getattr(ctx, name, None)
+            self.succ_off[id + 1] = len(self.succ)
+            self.pred_off[id + 1] = len(self.pred)
+
+
+    def get_start(self, n):
+        """Return the start address of a block"""
+        return self.start_lo[n] | (self.start_hi[n] << 32)
+
+
+    def get_end(self, n):
+        """Return the end address of a block"""
+        return self.end_lo[n] | (self.end_hi[n] << 32)
+
+
+    def succs(self, n):
+        """Return the successors of a block"""
+        return self.succ[self.succ_off[n]:self.succ_off[n + 1]]
+
+
+    def preds(self, n):
+        """Return the predecessors of a block"""
+        return self.pred[self.pred_off[n]:self.pred_off[n + 1]]
+
+
+    def column(self, name):
+        """Return a feature column: block id -> value"""
+        return self.columns[name]
 
 
 # ------------------------------------------------------------------------------
@@ -97,6 +209,8 @@ class BBMan(object):
         self.__idcache = {}
         self.__lasterr = None
         self.__is_using_cache = False
+        self.__addr_index = None
+        self.__graph = None
 
 
     def is_using_cache():
@@ -108,6 +222,8 @@ class BBMan(object):
         """Clear the basic blocks"""
         self.__idcache = {}
         self.__is_using_cache = False
+        self.__addr_index = None
+        self.__graph = None
 
         
     def last_error(self):
@@ -131,6 +247,48 @@ class BBMan(object):
 
         self.__is_using_cache = True
         self.__idcache = r
+        self.__addr_index = None
+        self.__graph = None
+        return True
+
+
+    def save_store(self, store, key, digest, block_digests):
+        """
+        Saves the basic blocks to a BBStore record
+        @param digest: The content digest of the function
+        @param block_digests: Dictionary: block id -> content digest
+        """
+        blocks = sorted(self.items(), key=lambda bb: bb.id)
+        ok, self.__lasterr = store.save(key, blocks, digest, block_digests)
+        return ok
+
+
+    def load_store(self, store, key, ctx_loader):
+        """
+        Load the basic blocks from a BBStore record
+        @param ctx_loader: Called with (record, block index, instruction count, flags)
+                           to build the context of each block
+        """
+        rec = store.get(key)
+        if rec is None:
+            self.__lasterr = "No record for %x in the store" % key
+            self.__is_using_cache = False
+            return False
+
+        self.clear()
+        try:
+            for i, (id, start, end, icount, flags) in enumerate(rec.blocks()):
+                bb = BBDef(id=id, start=start, end=end, ctx=ctx_loader(rec, i, icount, flags))
+                bb.succs = rec.succs(i)
+                bb.preds = rec.preds(i)
+                self.add(bb)
+        except (struct.error, ValueError, IndexError, KeyError) as e:
+            # A corrupted record is a cache miss
+            self.clear()
+            self.__lasterr = "Bad record for %x in the store: %s" % (key, e)
+            return False
+
+        self.__is_using_cache = True
         return True
 
 
@@ -139,6 +297,8 @@ class BBMan(object):
         
         # Cache the basic block by ID
         self.__idcache[bb.id] = bb
+        self.__addr_index = None
+        self.__graph = None
 
 
     def items(self):
@@ -164,13 +324,36 @@ class BBMan(object):
         pass
 
 
+    def addr_index(self):
+        """Return the address index of the basic blocks, building it on first use"""
+        if self.__addr_index is None:
+            self.__addr_index = BBAddrIndex(self.items())
+        return self.__addr_index
+
+
+    def links_changed(self):
+        """Drop the graph view after the successors or predecessors of the blocks changed"""
+        self.__graph = None
+
+
+    def graph(self):
+        """
+        Return the compact graph view of the basic blocks, building it on first use.
+        It is rebuilt after add() and links_changed()
+        """
+        if self.__graph is None:
+            self.__graph = BBGraph(self.items())
+        return self.__graph
+
+
     def find_by_addr(self, addr):
         """Return the basic block that contains the given address"""
-        for bb in self.items():
-            if bb.start <= addr < bb.end:
-                return bb
+        return self.addr_index().find(addr)
 
-        return None
+
+    def find_many_by_addr(self, addrs):
+        """Return the basic block (or None) that contains each given address"""
+        return self.addr_index().find_many(addrs)
 
     def build_from_id_string(self, conn):
         # Failed to load or no cache was to be used?
@@ -191,6 +374,8 @@ class BBMan(object):
                     self.add(bbi)
                 bb0.add_succ(bbi)
 
+        self.links_changed()
+
 # ------------------------------------------------------------------------------
 def __test():
     bm = BBMan()
@@ -55,6 +55,15 @@ def RekeyDictionary(d):
     return rkd
 
 
+# ------------------------------------------------------------------------------
+def Mix64(x):
+    """Derive a well mixed 64-bit key from an integer (splitmix64 finalizer)"""
+    m = (1 << 64) - 1
+    x = (x + 0x9E3779B97F4A7C15) & m
+    x = ((x ^ (x >> 30)) * 0xBF58476D1CE4E5B9) & m
+    x = ((x ^ (x >> 27)) * 0x94D049BB133111EB) & m
+    return x ^ (x >> 31)
+
 # ------------------------------------------------------------------------------
 def GenPrimes():
     """
@@ -0,0 +1,634 @@
+#include "bbfeatures.h"
+#include <ua.hpp>
+#include <algorithm>
+
+//--------------------------------------------------------------------------
+// The frequency tables intersection uses SSE2 when it is available
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+  #define FREQ_SIMD
+  #include <intrin.h>
+  #include <emmintrin.h>
+#elif defined(__SSE2__)
+  #define FREQ_SIMD
+  #include <emmintrin.h>
+#endif
+
+//--------------------------------------------------------------------------
+// Operand types are encoded in 4 bits each after the 16 bits of the itype
+#define OPTYPE_BITS    4
+#define ITYPE_BITS     16
+
+CASSERT(o_last <= (1 << OPTYPE_BITS));
+CASSERT(ITYPE_BITS + UA_MAXOP * OPTYPE_BITS <= 64);
+
+//--------------------------------------------------------------------------
+// Code of an operand in the characteristics list used by hash_itype2().
+// It lives above the itype range so that the two never mix
+static inline uint32 get_op_code(int n, uint32 type)
+{
+  return (1 << ITYPE_BITS) + (n * o_last) + type;
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Compute the characteristics of the last decoded instruction.
+*        Two instructions get the same key if and only if they have the same
+*        itype and the same operand types at the same operand positions
+*/
+static uint64 get_cmd_characteristics()
+{
+  uint64 r = cmd.itype;
+  for (int i=0; i < UA_MAXOP; i++)
+  {
+    const op_t &op = cmd.Operands[i];
+    if (op.type == o_void)
+      break;
+
+    r |= uint64(op.type) << (ITYPE_BITS + (i * OPTYPE_BITS));
+  }
+  return r;
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Split instruction characteristics into the itype and operand codes.
+*        Return the count of codes
+*/
+static int get_char_codes(uint64 c, uint32 codes[1 + UA_MAXOP])
+{
+  int n = 0;
+  codes[n++] = uint32(c & ((1 << ITYPE_BITS) - 1));
+  for (int i=0; i < UA_MAXOP; i++)
+  {
+    uint32 type = uint32(c >> (ITYPE_BITS + (i * OPTYPE_BITS))) & ((1 << OPTYPE_BITS) - 1);
+    if (type == o_void)
+      break;
+
+    codes[n++] = get_op_code(i, type);
+  }
+  return n;
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief 64-bit finalizer used to derive the keys of a code
+*/
+static inline uint64 mix64(uint64 x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+//--------------------------------------------------------------------------
+void multiset_hash_t::add(uint32 code)
+{
+  // Two independent keys per code. The sums wrap around modulo 2^64
+  lo += mix64(code);
+  hi += mix64(code | (1ULL << 32));
+}
+
+//--------------------------------------------------------------------------
+uint64 multiset_hash_t::digest() const
+{
+  hash64_t h;
+  h.update(lo);
+  h.update(hi);
+  return h.digest();
+}
+
+//--------------------------------------------------------------------------
+void hash_compat_t::add(uint64 old_hash, uint64 new_hash)
+{
+  ++blocks;
+
+  bool conflict = false;
+  std::map<uint64, uint64>::iterator it = old2new.find(old_hash);
+  if (it == old2new.end())
+    old2new[old_hash] = new_hash;
+  else if (it->second != new_hash)
+    conflict = true;
+
+  it = new2old.find(new_hash);
+  if (it == new2old.end())
+    new2old[new_hash] = old_hash;
+  else if (it->second != old_hash)
+    conflict = true;
+
+  if (conflict)
+    ++conflicts;
+}
+
+//--------------------------------------------------------------------------
+int decode_block(ea_t start, ea_t end, insn_chars_t &insns)
+{
+  int icount = 0;
+  while (start < end)
+  {
+    int sz = decode_insn(start);
+    if (sz <= 0)
+      break;
+
+    insns.push_back(get_cmd_characteristics());
+    ++icount;
+    start += sz;
+  }
+  return icount;
+}
+
+//--------------------------------------------------------------------------
+uint64 hash_itype1(const uint64 *insns, int count)
+{
+  // Hash the decimal itype strings like the Python version does
+  // so both implementations have the same equivalence classes
+  hash64_t h;
+  for (int i=0; i < count; i++)
+  {
+    char buf[16];
+    int len = qsnprintf(
+      buf,
+      sizeof(buf),
+      "%u",
+      uint32(insns[i] & ((1 << ITYPE_BITS) - 1)));
+    h.update(buf, len);
+  }
+  return h.digest();
+}
+
+//--------------------------------------------------------------------------
+uint64 hash_itype2(const uint64 *insns, int count)
+{
+  // The Python version multiplied one prime per itype and per operand type.
+  // The product identifies the multiset of factors: we sum up one key per
+  // factor instead, which is order insensitive and does not grow
+  multiset_hash_t h;
+  for (int i=0; i < count; i++)
+  {
+    uint32 codes[1 + UA_MAXOP];
+    int n = get_char_codes(insns[i], codes);
+    for (int j=0; j < n; j++)
+      h.add(codes[j]);
+  }
+  return h.digest();
+}
+
+//--------------------------------------------------------------------------
+uint64 hash_itype2_sorted(const uint64 *insns, int count)
+{
+  // Collect the factors and hash them in sorted order
+  qvector<uint32> codes;
+  for (int i=0; i < count; i++)
+  {
+    uint32 c[1 + UA_MAXOP];
+    int n = get_char_codes(insns[i], c);
+    for (int j=0; j < n; j++)
+      codes.push_back(c[j]);
+  }
+
+  std::sort(codes.begin(), codes.end());
+
+  hash64_t h;
+  if (!codes.empty())
+    h.update(&codes[0], codes.size() * sizeof(uint32));
+
+  return h.digest();
+}
+
+//--------------------------------------------------------------------------
+void check_hash_itype2_compat(qflow_chart_t &fc, hash_compat_t &compat)
+{
+  insn_chars_t insns;
+  for (int nid=0; nid < fc.size(); nid++)
+  {
+    qbasic_block_t &block = fc.blocks[nid];
+    insns.qclear();
+    int count = decode_block(block.startEA, block.endEA, insns);
+    const uint64 *block_insns = count == 0 ? NULL : &insns[0];
+    compat.add(
+      hash_itype2_sorted(block_insns, count),
+      hash_itype2(block_insns, count));
+  }
+}
+
+//--------------------------------------------------------------------------
+void get_block_frequency(const uint32 *chars, int count, freqtable_t &ft)
+{
+  ft.total = count;
+  ft.keys.qclear();
+  ft.counts.qclear();
+
+  qvector<uint32> sorted;
+  for (int i=0; i < count; i++)
+    sorted.push_back(chars[i]);
+  std::sort(sorted.begin(), sorted.end());
+
+  // Add up the frequency count of each characteristic
+  for (size_t i=0; i < sorted.size(); i++)
+  {
+    if (ft.keys.empty() || ft.keys.back() != sorted[i])
+    {
+      ft.keys.push_back(sorted[i]);
+      ft.counts.push_back(0);
+    }
+    ++ft.counts.back();
+  }
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Account for a characteristic present in both tables
+*/
+static inline void add_common_char(
+    freq_intersection_t &r,
+    hash64_t &h,
+    uint32 key,
+    int v1,
+    int v2)
+{
+  ++r.comm_count;
+  r.sum1 += v1;
+  r.sum2 += v2;
+  r.tp += double(qmin(v1, v2) * 100) / double(qmax(v1, v2));
+  h.update(uint64(key));
+}
+
+#ifdef FREQ_SIMD
+//--------------------------------------------------------------------------
+/**
+* @brief Check once if the processor supports SSE2
+*/
+static bool has_sse2()
+{
+#if defined(_MSC_VER) && defined(_M_IX86)
+  static int sse2 = -1;
+  if (sse2 == -1)
+  {
+    int info[4];
+    __cpuid(info, 1);
+    sse2 = (info[3] & (1 << 26)) != 0 ? 1 : 0;
+  }
+  return sse2 == 1;
+#else
+  return true;
+#endif
+}
+#endif
+
+//--------------------------------------------------------------------------
+void intersect_freq_tables(
+    const freqtable_t &ft1,
+    const freqtable_t &ft2,
+    freq_intersection_t &r)
+{
+  r.comm_count = 0;
+  r.sum1 = 0;
+  r.sum2 = 0;
+  r.tp = 0;
+
+  hash64_t h;
+  size_t n1 = ft1.keys.size(), n2 = ft2.keys.size();
+  size_t i = 0, j = 0;
+
+#ifdef FREQ_SIMD
+  // Compare blocks of 4 keys against each other: the keys of the first
+  // block are compared with the 4 rotations of the second block. The keys
+  // are unique so each common key is found exactly once and in order
+  if (n1 >= 4 && n2 >= 4 && has_sse2())
+  {
+    const uint32 *k1 = &ft1.keys[0], *k2 = &ft2.keys[0];
+    while (i + 4 <= n1 && j + 4 <= n2)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i *)(k1 + i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(k2 + j));
+      __m128i m = _mm_or_si128(
+        _mm_or_si128(
+          _mm_cmpeq_epi32(a, b),
+          _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1)))),
+        _mm_or_si128(
+          _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2))),
+          _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3)))));
+
+      int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+      for (int l=0; mask != 0; l++, mask >>= 1)
+      {
+        if ((mask & 1) == 0)
+          continue;
+
+        size_t jj = j;
+        while (k2[jj] != k1[i + l])
+          ++jj;
+
+        add_common_char(r, h, k1[i + l], ft1.counts[i + l], ft2.counts[jj]);
+      }
+
+      uint32 max1 = k1[i + 3], max2 = k2[j + 3];
+      if (max1 <= max2)
+        i += 4;
+      if (max2 <= max1)
+        j += 4;
+    }
+  }
+#endif
+
+  // Merge the remaining keys
+  while (i < n1 && j < n2)
+  {
+    uint32 a = ft1.keys[i], b = ft2.keys[j];
+    if (a < b)
+    {
+      ++i;
+    }
+    else if (b < a)
+    {
+      ++j;
+    }
+    else
+    {
+      add_common_char(r, h, a, ft1.counts[i], ft2.counts[j]);
+      ++i;
+      ++j;
+    }
+  }
+  r.hash = h.digest();
+}
+
+//--------------------------------------------------------------------------
+void match_block_frequencies(
+    const freqtable_t &ft1,
+    const freqtable_t &ft2,
+    double p1,
+    double p2,
+    bool *ok1,
+    bool *ok2,
+    uint64 *comm_hash)
+{
+  freq_intersection_t r;
+  intersect_freq_tables(ft1, ft2, r);
+
+  // Like the Python version, the common count of the small table is
+  // compared with the total of the first table
+  int ct1 = r.sum1, ct2 = r.sum2;
+  if (ft1.keys.size() > ft2.keys.size())
+    std::swap(ct1, ct2);
+
+  // Compute how much the common match in each frequency table
+  if (ft1.total == 0 || ft2.total == 0)
+  {
+    *ok1 = false;
+  }
+  else
+  {
+    double cp1 = (100.0 * ct1) / double(ft1.total);
+    double cp2 = (100.0 * ct2) / double(ft2.total);
+    *ok1 = cp1 > p1 && cp2 > p1;
+  }
+
+  // Compute the percent of the common match
+  *ok2 = r.comm_count != 0 && (r.tp / r.comm_count) > p2;
+
+  if (comm_hash != NULL)
+    *comm_hash = r.hash;
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Order block ids by start address
+*/
+struct start_less_t
+{
+  const bbfeature_table_t &features;
+  start_less_t(const bbfeature_table_t &f): features(f)
+  {
+  }
+
+  bool operator()(int n1, int n2) const
+  {
+    return features[n1].start < features[n2].start;
+  }
+};
+
+//--------------------------------------------------------------------------
+void bbfeature_table_t::build(qflow_chart_t &fc)
+{
+  int nodes_count = fc.size();
+  clear();
+  resize(nodes_count);
+
+  // Decode all the blocks once
+  for (int nid=0; nid < nodes_count; nid++)
+  {
+    qbasic_block_t &block = fc.blocks[nid];
+    bbfeature_t &f = (*this)[nid];
+
+    f.start      = block.startEA;
+    f.end        = block.endEA;
+    f.first_insn = insns.size();
+    f.inst_count = decode_block(block.startEA, block.endEA, insns);
+  }
+
+  // Number the distinct characteristics in ascending order
+  char_keys = insns;
+  std::sort(char_keys.begin(), char_keys.end());
+  char_keys.resize(std::unique(char_keys.begin(), char_keys.end()) - char_keys.begin());
+
+  qvector<uint32> chars;
+  chars.resize(insns.size());
+  for (size_t i=0; i < insns.size(); i++)
+  {
+    chars[i] = uint32(std::lower_bound(
+      char_keys.begin(),
+      char_keys.end(),
+      insns[i]) - char_keys.begin());
+  }
+
+  // Number the distinct itypes for the edit distance
+  qvector<uint32> itypes;
+  itype_ids.resize(insns.size());
+  for (size_t i=0; i < insns.size(); i++)
+    itypes.push_back(uint32(insns[i] & ((1 << ITYPE_BITS) - 1)));
+  std::sort(itypes.begin(), itypes.end());
+  itypes.resize(std::unique(itypes.begin(), itypes.end()) - itypes.begin());
+  itype_count = itypes.size();
+  for (size_t i=0; i < insns.size(); i++)
+  {
+    itype_ids[i] = uint32(std::lower_bound(
+      itypes.begin(),
+      itypes.end(),
+      uint32(insns[i] & ((1 << ITYPE_BITS) - 1))) - itypes.begin());
+  }
+
+  // Compute the features from the instruction characteristics
+  for (int nid=0; nid < nodes_count; nid++)
+  {
+    bbfeature_t &f = (*this)[nid];
+    const uint64 *block_insns = get_insns(nid);
+
+    f.hash_itype1 = hash_itype1(block_insns, f.inst_count);
+    f.hash_itype2 = hash_itype2(block_insns, f.inst_count);
+    get_block_frequency(
+      chars.empty() ? NULL : &chars[0] + f.first_insn,
+      f.inst_count,
+      f.freq);
+  }
+
+  // Index the blocks by address. The blocks of a flowchart do not overlap
+  for (int nid=0; nid < nodes_count; nid++)
+  {
+    if ((*this)[nid].start < (*this)[nid].end)
+      addr_order.push_back(nid);
+  }
+  std::sort(addr_order.begin(), addr_order.end(), start_less_t(*this));
+}
+
+//--------------------------------------------------------------------------
+int bbfeature_table_t::find_by_addr(ea_t ea) const
+{
+  // Find the last block that starts at or before the address
+  size_t lo = 0, hi = addr_order.size();
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if ((*this)[addr_order[mid]].start <= ea)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return -1;
+
+  int nid = addr_order[lo - 1];
+  return ea < (*this)[nid].end ? nid : -1;
+}
+
+//--------------------------------------------------------------------------
+void bbfeature_table_t::find_by_addrs(
+    const eavec_t &addrs,
+    intvec_t &nodes) const
+{
+  nodes.resize(addrs.size());
+
+  // Nearby addresses often fall in the same block: try the last hit first
+  int last = -1;
+  for (size_t i=0; i < addrs.size(); i++)
+  {
+    ea_t ea = addrs[i];
+    if (last == -1 || ea < (*this)[last].start || ea >= (*this)[last].end)
+    {
+      int nid = find_by_addr(ea);
+      if (nid != -1)
+        last = nid;
+      nodes[i] = nid;
+    }
+    else
+    {
+      nodes[i] = last;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+void bbfeature_table_t::clear()
+{
+  qclear();
+  insns.qclear();
+  char_keys.qclear();
+  itype_ids.qclear();
+  itype_count = 0;
+  addr_order.qclear();
+}
+
+//--------------------------------------------------------------------------
+void edit_pattern_t::compile(const uint32 *ids, int len, int alphabet)
+{
+  // Only clear the bitmasks of the previous pattern
+  if (int(peq.size()) != alphabet)
+  {
+    peq.qclear();
+    peq.resize(alphabet, 0);
+  }
+  else
+  {
+    for (size_t i=0; i < used.size(); i++)
+      peq[used[i]] = 0;
+  }
+  used.qclear();
+
+  this->ids = ids;
+  this->len = len;
+  if (len > 64)
+    return;
+
+  for (int i=0; i < len; i++)
+  {
+    if (peq[ids[i]] == 0)
+      used.push_back(ids[i]);
+    peq[ids[i]] |= 1ULL << i;
+  }
+}
+
+//--------------------------------------------------------------------------
+int edit_pattern_t::distance(const uint32 *text, int text_len, int max_dist) const
+{
+  if (len == 0)
+    return text_len;
+
+  // Each length difference costs one insertion or deletion
+  if (len - text_len > max_dist || text_len - len > max_dist)
+    return max_dist + 1;
+
+  // Long blocks are rare: use the dynamic programming recurrence
+  if (len > 64)
+  {
+    intvec_t col;
+    col.resize(len + 1);
+    for (int i=0; i <= len; i++)
+      col[i] = i;
+
+    for (int j=0; j < text_len; j++)
+    {
+      int diag = col[0];
+      col[0] = j + 1;
+      int best = col[0];
+      for (int i=1; i <= len; i++)
+      {
+        int up = col[i];
+        col[i] = qmin(qmin(up, col[i - 1]) + 1, diag + (ids[i - 1] == text[j] ? 0 : 1));
+        diag = up;
+        best = qmin(best, col[i]);
+      }
+      if (best > max_dist)
+        return max_dist + 1;
+    }
+    return col[len];
+  }
+
+  // One column of the dynamic programming matrix is encoded in the
+  // vertical positive and negative deltas. 'score' follows the last row
+  uint64 pv = ~0ULL, mv = 0;
+  uint64 last = 1ULL << (len - 1);
+  int score = len;
+  for (int j=0; j < text_len; j++)
+  {
+    uint64 eq = peq[text[j]];
+    uint64 xv = eq | mv;
+    uint64 xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64 ph = mv | ~(xh | pv);
+    uint64 mh = pv & xh;
+    if ((ph & last) != 0)
+      ++score;
+    else if ((mh & last) != 0)
+      --score;
+
+    // The first row is the distance to the empty pattern: always +1
+    ph = (ph << 1) | 1;
+    mh <<= 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+
+    // The score decreases by one at most per remaining column
+    if (score - (text_len - j - 1) > max_dist)
+      return max_dist + 1;
+  }
+  return score;
+}
@@ -0,0 +1,412 @@
+#ifndef __BBFEATURES__
+#define __BBFEATURES__
+
+/*--------------------------------------------------------------------------
+GraphSlick (c) Elias Bachaalany
+-------------------------------------
+
+Basic block features module
+
+This module computes the per-block characteristics used by the native
+matcher. It is the C++ counterpart of the hashing helpers found in bb_ida.py
+
+--------------------------------------------------------------------------*/
+
+//--------------------------------------------------------------------------
+#include <map>
+#include <pro.h>
+#include <gdl.hpp>
+
+//--------------------------------------------------------------------------
+/**
+* @brief Simple incremental 64-bit hasher (FNV-1a with a final avalanche)
+*/
+class hash64_t
+{
+  uint64 h;
+public:
+  hash64_t(): h(0xCBF29CE484222325ULL)
+  {
+  }
+
+  /**
+  * @brief Hash a buffer
+  */
+  hash64_t &update(const void *buf, size_t sz)
+  {
+    const uchar *p = (const uchar *)buf;
+    for (size_t i=0; i < sz; i++)
+    {
+      h ^= p[i];
+      h *= 0x100000001B3ULL;
+    }
+    return *this;
+  }
+
+  /**
+  * @brief Hash a 64-bit value
+  */
+  hash64_t &update(uint64 v)
+  {
+    return update(&v, sizeof(v));
+  }
+
+  /**
+  * @brief Return the digest. The hasher state is not altered
+  */
+  uint64 digest() const
+  {
+    uint64 x = h;
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Order insensitive 128-bit hash of a multiset of characteristic codes.
+*        Each code is mapped to two 64-bit keys that are summed up
+*/
+class multiset_hash_t
+{
+  uint64 lo, hi;
+public:
+  multiset_hash_t(): lo(0), hi(0)
+  {
+  }
+
+  /**
+  * @brief Add a code to the multiset
+  */
+  void add(uint32 code);
+
+  /**
+  * @brief Fold the two sums into a 64-bit digest
+  */
+  uint64 digest() const;
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Check that two block hashes define the same equivalence classes:
+*        two blocks have the same old hash if and only if they have the same
+*        new hash
+*/
+class hash_compat_t
+{
+  std::map<uint64, uint64> old2new;
+  std::map<uint64, uint64> new2old;
+
+public:
+  /**
+  * @brief Count of checked blocks
+  */
+  int blocks;
+
+  /**
+  * @brief Count of blocks that break the equivalence
+  */
+  int conflicts;
+
+  hash_compat_t(): blocks(0), conflicts(0)
+  {
+  }
+
+  /**
+  * @brief Add the old and new hashes of a block
+  */
+  void add(uint64 old_hash, uint64 new_hash);
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Instruction characteristic frequency table.
+*        The characteristics are numbered per function in ascending order
+*        (see bbfeature_table_t), the numbers play the role of the prime
+*        products in get_block_frequency()
+*/
+struct freqtable_t
+{
+  /**
+  * @brief Total instruction count
+  */
+  int total;
+
+  /**
+  * @brief Characteristic numbers in ascending order
+  */
+  qvector<uint32> keys;
+
+  /**
+  * @brief Frequency of each characteristic
+  */
+  intvec_t counts;
+
+  freqtable_t(): total(0)
+  {
+  }
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief The characteristics two frequency tables have in common
+*/
+struct freq_intersection_t
+{
+  /**
+  * @brief Count of common characteristics
+  */
+  int comm_count;
+
+  /**
+  * @brief Sum of the frequencies of the common characteristics in each table
+  */
+  int sum1, sum2;
+
+  /**
+  * @brief Sum of the min/max frequency ratios (in percent)
+  */
+  double tp;
+
+  /**
+  * @brief Hash of the common characteristics
+  */
+  uint64 hash;
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Bit-parallel edit distance between the itype sequence of a block
+*        (the pattern) and other sequences of the same function (Myers).
+*        The itypes are numbered per function (see bbfeature_table_t) so
+*        the pattern is compiled into one bitmask per itype number
+*/
+class edit_pattern_t
+{
+  /**
+  * @brief Itype number -> bitmask of its positions in the pattern
+  */
+  qvector<uint64> peq;
+
+  /**
+  * @brief Itype numbers with a bitmask set
+  */
+  qvector<uint32> used;
+
+  const uint32 *ids;
+  int len;
+
+public:
+  edit_pattern_t(): ids(NULL), len(0)
+  {
+  }
+
+  /**
+  * @brief Compile a pattern. The buffers are reused between the patterns
+  */
+  void compile(const uint32 *ids, int len, int alphabet);
+
+  /**
+  * @brief Return the edit distance to a sequence. The computation stops
+  *        early and returns a value over 'max_dist' once the distance
+  *        cannot be 'max_dist' or less
+  */
+  int distance(const uint32 *text, int text_len, int max_dist) const;
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Instruction characteristics: the itype in the low 16 bits followed
+*        by the type of each operand in 4 bits
+*/
+typedef qvector<uint64> insn_chars_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Per basic block features
+*/
+struct bbfeature_t
+{
+  ea_t start;
+  ea_t end;
+
+  /**
+  * @brief Instruction count
+  */
+  int inst_count;
+
+  /**
+  * @brief Index of the characteristics of the first instruction
+  *        in the feature table
+  */
+  int first_insn;
+
+  /**
+  * @brief Hash of the ordered itype sequence
+  */
+  uint64 hash_itype1;
+
+  /**
+  * @brief Order insensitive hash of the itypes and operand types
+  */
+  uint64 hash_itype2;
+
+  /**
+  * @brief Instruction characteristics frequency table
+  */
+  freqtable_t freq;
+
+  bbfeature_t(): start(BADADDR), end(BADADDR), inst_count(0), first_insn(0),
+                 hash_itype1(0), hash_itype2(0)
+  {
+  }
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Per function feature table. It is indexed by the flowchart node id.
+*        Each block is decoded once: all the features are computed from the
+*        instruction characteristics that are stored block after block
+*/
+class bbfeature_table_t: public qvector<bbfeature_t>
+{
+  insn_chars_t insns;
+
+  /**
+  * @brief The distinct characteristics in ascending order.
+  *        The frequency tables use the indices in this list
+  */
+  insn_chars_t char_keys;
+
+  /**
+  * @brief Itype number of each instruction and count of distinct itypes
+  */
+  qvector<uint32> itype_ids;
+  int itype_count;
+
+  /**
+  * @brief Ids of the non empty blocks sorted by start address
+  */
+  intvec_t addr_order;
+
+public:
+  bbfeature_table_t(): itype_count(0)
+  {
+  }
+
+  /**
+  * @brief Compute the features of all the blocks of a flowchart
+  */
+  void build(qflow_chart_t &fc);
+
+  /**
+  * @brief Return the instruction characteristics of a block
+  */
+  const uint64 *get_insns(int n) const
+  {
+    return insns.empty() ? NULL : &insns[0] + (*this)[n].first_insn;
+  }
+
+  /**
+  * @brief Return the itype numbers of the instructions of a block
+  */
+  const uint32 *get_itype_ids(int n) const
+  {
+    return itype_ids.empty() ? NULL : &itype_ids[0] + (*this)[n].first_insn;
+  }
+
+  /**
+  * @brief Return the count of distinct itypes in the function
+  */
+  int get_itype_count() const
+  {
+    return itype_count;
+  }
+
+  /**
+  * @brief Return the id of the block that contains an address or -1.
+  *        Binary search over the blocks sorted by start address
+  */
+  int find_by_addr(ea_t ea) const;
+
+  /**
+  * @brief Look up many addresses at once. 'nodes' receives the id of the
+  *        block that contains each address or -1
+  */
+  void find_by_addrs(const eavec_t &addrs, intvec_t &nodes) const;
+
+  /**
+  * @brief Remove all the blocks
+  */
+  void clear();
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Decode a block and append the characteristics of its instructions.
+*        Return the instruction count
+*/
+int decode_block(ea_t start, ea_t end, insn_chars_t &insns);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Hash a block based on the instruction sequence
+*/
+uint64 hash_itype1(const uint64 *insns, int count);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Hash a block based on the instruction sequence.
+*        Take into consideration the operands
+*/
+uint64 hash_itype2(const uint64 *insns, int count);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Reference version of hash_itype2(): hash the sorted characteristic
+*        codes. It identifies the same multisets as the prime product
+*/
+uint64 hash_itype2_sorted(const uint64 *insns, int count);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Compare hash_itype2() with hash_itype2_sorted() on all the blocks
+*        of a flowchart
+*/
+void check_hash_itype2_compat(qflow_chart_t &fc, hash_compat_t &compat);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Compute a table of instruction characteristic frequency
+*        from the characteristic numbers of the instructions
+*/
+void get_block_frequency(const uint32 *chars, int count, freqtable_t &ft);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Intersect two frequency tables
+*/
+void intersect_freq_tables(
+    const freqtable_t &ft1,
+    const freqtable_t &ft2,
+    freq_intersection_t &r);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Compute the percentage of match between two frequency tables.
+*        Optionally return the hash of the common characteristics
+*/
+void match_block_frequencies(
+    const freqtable_t &ft1,
+    const freqtable_t &ft2,
+    double p1,
+    double p2,
+    bool *ok1,
+    bool *ok2,
+    uint64 *comm_hash = NULL);
+
+#endif
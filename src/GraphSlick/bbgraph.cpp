@@ -0,0 +1,25 @@
+#include "bbgraph.h"
+
+//--------------------------------------------------------------------------
+void adjlist_t::build(qflow_chart_t &fc, bool preds)
+{
+  int nodes_count = fc.size();
+  qclear();
+  offsets.reserve(nodes_count + 1);
+  for (int nid=0; nid < nodes_count; nid++)
+  {
+    int first = targets.size();
+    for (int i=0, sz=preds ? fc.npred(nid) : fc.nsucc(nid); i < sz; i++)
+    {
+      int n = preds ? fc.pred(nid, i) : fc.succ(nid, i);
+
+      // The rows are short: a linear scan is enough to drop the duplicates
+      bool dup = false;
+      for (int j=first, cnt=targets.size(); j < cnt && !dup; j++)
+        dup = targets[j] == n;
+      if (!dup)
+        targets.push_back(n);
+    }
+    offsets.push_back(targets.size());
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef __BBGRAPH__
+#define __BBGRAPH__
+
+/*--------------------------------------------------------------------------
+GraphSlick (c) Elias Bachaalany
+-------------------------------------
+
+Basic block graph module
+
+Compact adjacency lists of a flowchart: the neighbours of all the nodes are
+stored back to back in one array (compressed sparse rows) instead of one
+vector per node. It is the C++ counterpart of bb_types.BBGraph
+
+--------------------------------------------------------------------------*/
+
+//--------------------------------------------------------------------------
+#include <pro.h>
+#include <gdl.hpp>
+#include "types.hpp"
+
+//--------------------------------------------------------------------------
+/**
+* @brief Read only view of the neighbours of a node
+*/
+class nodespan_t
+{
+  const int *first;
+  const int *last;
+
+public:
+  nodespan_t(const int *f, const int *l): first(f), last(l)
+  {
+  }
+
+  const int *begin() const
+  {
+    return first;
+  }
+
+  const int *end() const
+  {
+    return last;
+  }
+
+  size_t size() const
+  {
+    return last - first;
+  }
+
+  bool empty() const
+  {
+    return first == last;
+  }
+
+  int operator[](size_t i) const
+  {
+    return first[i];
+  }
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Adjacency lists in compressed sparse row form. The neighbours of
+*        node 'n' are targets[offsets[n]] to targets[offsets[n+1]-1]
+*/
+class adjlist_t
+{
+  intvec_t offsets;
+  intvec_t targets;
+
+public:
+  adjlist_t()
+  {
+    offsets.push_back(0);
+  }
+
+  /**
+  * @brief Build the successors (or the predecessors) lists of a flowchart.
+  *        The duplicate edges are only kept once
+  */
+  void build(qflow_chart_t &fc, bool preds);
+
+  /**
+  * @brief Remove all the nodes
+  */
+  void qclear()
+  {
+    offsets.qclear();
+    targets.qclear();
+    offsets.push_back(0);
+  }
+
+  /**
+  * @brief Return the count of nodes
+  */
+  size_t size() const
+  {
+    return offsets.size() - 1;
+  }
+
+  bool empty() const
+  {
+    return size() == 0;
+  }
+
+  /**
+  * @brief Return the count of edges
+  */
+  size_t edges_count() const
+  {
+    return targets.size();
+  }
+
+  /**
+  * @brief Return the neighbours of a node
+  */
+  nodespan_t operator[](int n) const
+  {
+    const int *base = targets.empty() ? NULL : &targets[0];
+    return nodespan_t(base + offsets[n], base + offsets[n + 1]);
+  }
+};
+
+#endif
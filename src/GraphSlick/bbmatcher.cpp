@@ -0,0 +1,1803 @@
+#include "bbmatcher.h"
+#include "util.h"
+#include <algorithm>
+
+//--------------------------------------------------------------------------
+// Blocks shorter than this only match by edit distance if they are equal.
+// Longer blocks are allowed one more edit every EDIT_INSNS_PER_EDIT insns
+#define EDIT_MIN_INSNS       4
+#define EDIT_INSNS_PER_EDIT  8
+
+// Maximum count of node pairs each worker remembers the edit match of
+#define EDIT_PAIRS_MAX       65536
+
+//--------------------------------------------------------------------------
+// Count of seed pairs a worker takes at once
+#define SEED_CHUNK_SIZE     16
+
+// Below this count of seed pairs the exploration is done by the caller thread
+#define MIN_PARALLEL_SEEDS  64
+
+// Minimum count of seed pairs explored before a selection round
+#define MIN_STAGE_SEEDS     256
+
+//--------------------------------------------------------------------------
+/**
+* @brief Lexicographic comparison of two node lists
+*/
+static bool intvec_less(const intvec_t &a, const intvec_t &b)
+{
+  return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Compare two supergroups by their first node list
+*/
+static bool int_2dvec_less(const int_2dvec_t &a, const int_2dvec_t &b)
+{
+  return std::lexicographical_compare(
+    a.begin(), a.end(),
+    b.begin(), b.end(),
+    intvec_less);
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Label a hash value with its type so that hashes of different types
+*        never compare equal
+*/
+static uint64 label_hash(uint64 h, bbhash_type_t hash_type)
+{
+  hash64_t lh;
+  lh.update(uint64(hash_type));
+  lh.update(h);
+  return lh.digest();
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Order the seed pairs like list_seed_pairs() does
+*/
+static bool seed_pair_less(const seed_pair_t &a, const seed_pair_t &b)
+{
+  if (a.node_hash != b.node_hash)
+    return a.node_hash < b.node_hash;
+  if (a.node1 != b.node1)
+    return a.node1 < b.node1;
+  return a.node2 < b.node2;
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Order the seed results by seed index
+*/
+static bool seed_result_less(const seed_result_t *a, const seed_result_t *b)
+{
+  return a->seed < b->seed;
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Order node occurrences by path index
+*/
+static bool nodepos_less(const nodepos_t &a, const nodepos_t &b)
+{
+  return a.path < b.path;
+}
+
+//--------------------------------------------------------------------------
+bool pathlist_t::add_path(const intvec_t &path)
+{
+  hash64_t h;
+  if (!path.empty())
+    h.update(&path[0], path.size() * sizeof(int));
+
+  int idx = int(size());
+  int first = index.insert(h.digest(), idx);
+  if (first != idx)
+  {
+    // Same hash: compare with all the paths of the chain
+    for (int i=first; i != -1; i=next[i])
+    {
+      if ((*this)[i] == path)
+        return false;
+    }
+
+    // Link the new path after the first one
+    next.push_back(next[first]);
+    next[first] = idx;
+  }
+  else
+  {
+    next.push_back(-1);
+  }
+
+  push_back(path);
+  paths_size += sizeof(intvec_t) + path.size() * sizeof(int);
+  return true;
+}
+
+//--------------------------------------------------------------------------
+void pathlist_t::release()
+{
+  qclear();
+  index.clear();
+  next.qclear();
+  paths_size = 0;
+}
+
+//--------------------------------------------------------------------------
+void nodeset_t::create(int nodes_count, const intvec_t &nodes)
+{
+  words.qclear();
+  words.resize((nodes_count + 63) / 64, 0);
+  lo = int(words.size());
+  hi = 0;
+  for (intvec_t::const_iterator it=nodes.begin(); it != nodes.end(); ++it)
+  {
+    int w = *it >> 6;
+    words[w] |= 1ULL << (*it & 63);
+    lo = qmin(lo, w);
+    hi = qmax(hi, w + 1);
+  }
+}
+
+//--------------------------------------------------------------------------
+bool nodeset_t::is_subset_of(const nodeset_t &other) const
+{
+  for (int w=lo; w < hi; w++)
+  {
+    if ((words[w] & ~other.words[w]) != 0)
+      return false;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------
+bbprogress_t::bbprogress_t()
+{
+  lock = qmutex_create();
+  reset();
+}
+
+//--------------------------------------------------------------------------
+bbprogress_t::~bbprogress_t()
+{
+  qmutex_free(lock);
+}
+
+//--------------------------------------------------------------------------
+void bbprogress_t::reset()
+{
+  qmutex_lock(lock);
+  seeds_total = seeds_done = paths_found = 0;
+  cancelled = false;
+  qmutex_unlock(lock);
+}
+
+//--------------------------------------------------------------------------
+void bbprogress_t::set_seeds_total(size_t count)
+{
+  qmutex_lock(lock);
+  seeds_total = count;
+  qmutex_unlock(lock);
+}
+
+//--------------------------------------------------------------------------
+void bbprogress_t::add_seeds(size_t count, size_t paths)
+{
+  qmutex_lock(lock);
+  seeds_done += count;
+  paths_found += paths;
+  qmutex_unlock(lock);
+}
+
+//--------------------------------------------------------------------------
+void bbprogress_t::get(size_t *total, size_t *done, size_t *paths)
+{
+  qmutex_lock(lock);
+  *total = seeds_total;
+  *done = seeds_done;
+  *paths = paths_found;
+  qmutex_unlock(lock);
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Work stealing scheduler over the seed pair indices.
+*        Each worker owns a range of seeds and takes chunks from its front.
+*        A worker whose range is exhausted steals the back half of the
+*        largest remaining range
+*/
+class seed_scheduler_t
+{
+  struct range_t
+  {
+    size_t next;
+    size_t end;
+  };
+  qvector<range_t> ranges;
+  qmutex_t lock;
+
+public:
+  seed_scheduler_t(size_t count, int nworkers)
+  {
+    lock = qmutex_create();
+    ranges.resize(nworkers);
+    for (int i=0; i < nworkers; i++)
+    {
+      ranges[i].next = count * i / nworkers;
+      ranges[i].end = count * (i + 1) / nworkers;
+    }
+  }
+
+  ~seed_scheduler_t()
+  {
+    qmutex_free(lock);
+  }
+
+  /**
+  * @brief Get the next chunk [first, last) of seeds for a worker.
+  *        Return false when there is nothing left to do
+  */
+  bool get_work(int worker, size_t *first, size_t *last)
+  {
+    qmutex_lock(lock);
+
+    range_t &r = ranges[worker];
+    if (r.next == r.end)
+    {
+      // Steal from the worker with the most remaining seeds
+      int victim = -1;
+      size_t victim_left = 0;
+      for (size_t i=0; i < ranges.size(); i++)
+      {
+        size_t left = ranges[i].end - ranges[i].next;
+        if (left > victim_left)
+        {
+          victim = int(i);
+          victim_left = left;
+        }
+      }
+
+      if (victim != -1)
+      {
+        range_t &v = ranges[victim];
+        size_t mid = v.end - (victim_left + 1) / 2;
+        r.next = mid;
+        r.end = v.end;
+        v.end = mid;
+      }
+    }
+
+    bool ok = r.next != r.end;
+    if (ok)
+    {
+      *first = r.next;
+      r.next = qmin(r.end, r.next + SEED_CHUNK_SIZE);
+      *last = r.next;
+    }
+
+    qmutex_unlock(lock);
+    return ok;
+  }
+};
+
+//--------------------------------------------------------------------------
+struct seed_worker_t
+{
+  const BBMatcher *matcher;
+  const seed_pair_vec_t *seeds;
+  seed_scheduler_t *sched;
+  bbprogress_t *progress;
+  int id;
+  bfs_state_t state;
+  seed_result_vec_t results;
+
+  /**
+  * @brief Storage of the full paths when the memory is bounded
+  */
+  path_arena_t *arena;
+
+  /**
+  * @brief Exploration order of the seeds and first seed of the stage
+  */
+  const qvector<size_t> *order;
+  size_t first;
+
+  /**
+  * @brief Pool running the worker thread, the stage start signal and the
+  *        exit request
+  */
+  seed_pool_t *pool;
+  qsemaphore_t start;
+  bool quit;
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Seed worker threads started once and fed all the stages of an
+*        exploration. The calling thread is the first worker
+*/
+class seed_pool_t
+{
+  qvector<seed_worker_t> &workers;
+  qthread_cb_t work;
+
+  /**
+  * @brief Thread of each worker. The first one is the caller. If a thread
+  *        cannot be created then its range is stolen by the other workers
+  */
+  qvector<qthread_t> threads;
+
+  /**
+  * @brief Posted by each thread when it is done with a stage
+  */
+  qsemaphore_t done;
+
+  // Not copyable
+  seed_pool_t(const seed_pool_t &);
+  seed_pool_t &operator=(const seed_pool_t &);
+
+  static int idaapi thread_main(void *ud);
+
+public:
+  seed_pool_t(qvector<seed_worker_t> &w, qthread_cb_t cb)
+    : workers(w), work(cb), done(NULL)
+  {
+    threads.push_back(NULL);
+  }
+
+  ~seed_pool_t();
+
+  /**
+  * @brief Run 'nworkers' workers on the current stage and wait for them.
+  *        The missing threads are started on the first stage needing them
+  */
+  void run(int nworkers);
+};
+
+//--------------------------------------------------------------------------
+int idaapi seed_pool_t::thread_main(void *ud)
+{
+  seed_worker_t *w = (seed_worker_t *)ud;
+  while (qsem_wait(w->start, -1) && !w->quit)
+  {
+    w->pool->work(w);
+    qsem_post(w->pool->done);
+  }
+  return 0;
+}
+
+//--------------------------------------------------------------------------
+seed_pool_t::~seed_pool_t()
+{
+  for (size_t i=1; i < threads.size(); i++)
+  {
+    seed_worker_t &w = workers[i];
+    if (threads[i] != NULL)
+    {
+      w.quit = true;
+      qsem_post(w.start);
+      qthread_join(threads[i]);
+      qthread_free(threads[i]);
+    }
+    if (w.start != NULL)
+      qsem_free(w.start);
+  }
+
+  if (done != NULL)
+    qsem_free(done);
+}
+
+//--------------------------------------------------------------------------
+void seed_pool_t::run(int nworkers)
+{
+  if (nworkers > 1 && done == NULL)
+    done = qsem_create(NULL, 0);
+
+  while (done != NULL && int(threads.size()) < nworkers)
+  {
+    seed_worker_t &w = workers[threads.size()];
+    w.pool = this;
+    w.quit = false;
+    w.start = qsem_create(NULL, 0);
+
+    qthread_t t = NULL;
+    if (w.start != NULL)
+      t = qthread_create(thread_main, &w);
+    threads.push_back(t);
+  }
+
+  int started = 0;
+  for (int i=1; i < nworkers && i < int(threads.size()); i++)
+  {
+    if (threads[i] != NULL)
+    {
+      qsem_post(workers[i].start);
+      ++started;
+    }
+  }
+
+  work(&workers[0]);
+
+  for (int i=0; i < started; i++)
+    qsem_wait(done, -1);
+}
+
+//--------------------------------------------------------------------------
+void bfs_state_t::reset(int nodes_count)
+{
+  epoch = 0;
+  visited1.qclear();
+  visited2.qclear();
+  in_path1.qclear();
+  in_path2.qclear();
+  visited1.resize(nodes_count, 0);
+  visited2.resize(nodes_count, 0);
+  in_path1.resize(nodes_count, 0);
+  in_path2.resize(nodes_count, 0);
+  path_pos.qclear();
+  path_pos.resize(nodes_count, -1);
+  edit_node = -1;
+  edit_pairs.clear();
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::clear()
+{
+  succs.qclear();
+  preds.qclear();
+  doms.clear();
+  features.clear();
+  for (int t=0; t < BBH_FREQ; t++)
+    succ_hashes[t].qclear();
+  node_matches.clear();
+  path_per_nhash.clear();
+  path_per_nhash_full.clear();
+  full_arena.clear();
+  selection_size = 0;
+  size_dic.qclear();
+  full_paths.qclear();
+  node_paths.qclear();
+  head_paths.qclear();
+  normalized.qclear();
+  moved.qclear();
+  moved_per_node.qclear();
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::build_graph(qflow_chart_t &fc)
+{
+  succs.build(fc, false);
+  preds.build(fc, true);
+}
+
+//--------------------------------------------------------------------------
+uint64 BBMatcher::get_node_hash(int n, bbhash_type_t hash_type) const
+{
+  const bbfeature_t &f = features[n];
+  return label_hash(
+    hash_type == BBH_ITYPE1 ? f.hash_itype1 : f.hash_itype2,
+    hash_type);
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::match(
+    int n1,
+    int n2,
+    bbhash_type_t hash_type,
+    uint64 *freq_hash) const
+{
+  if (hash_type != BBH_FREQ)
+    return get_node_hash(n1, hash_type) == get_node_hash(n2, hash_type);
+
+  const freqtable_t &f1 = features[n1].freq;
+  const freqtable_t &f2 = features[n2].freq;
+  int a = f1.total, b = f2.total;
+
+  double coverage;
+  if (a <= 4 || b <= 4)
+    coverage = 50;
+  else if (a <= 6 || b <= 6)
+    coverage = 60;
+  else if (a <= 8 || b <= 8)
+    coverage = 75;
+  else
+    coverage = 85;
+
+  bool b1, b2;
+  uint64 comm_hash;
+  match_block_frequencies(f1, f2, coverage, 95, &b1, &b2, &comm_hash);
+  if (!b1 || !b2)
+    return false;
+
+  if (freq_hash != NULL)
+    *freq_hash = label_hash(comm_hash, BBH_FREQ);
+
+  return true;
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::hash_bb_match(bbhash_type_t hash_type)
+{
+  int nodes_count = features.size();
+
+  // The fuzzy frequency match is not transitive: compare all the pairs
+  if (hash_type == BBH_FREQ)
+  {
+    for (int i=0; i < nodes_count && !progress.is_cancelled(); i++)
+    {
+      for (int j=i+1; j < nodes_count; j++)
+      {
+        uint64 x;
+        if (!match(i, j, hash_type, &x))
+          continue;
+
+        intvec_t *nodes = node_matches.find(x);
+        if (nodes == NULL)
+        {
+          nodes = &node_matches[x];
+          nodes->push_back(i);
+          nodes->push_back(j);
+        }
+        else
+        {
+          nodes->add_unique(j);
+        }
+      }
+    }
+    return;
+  }
+
+  // Exact hashes: bucket the nodes by hash in one pass.
+  // Each bucket lists the node ids in ascending order
+  digest_index_t index(nodes_count);
+  qvector<uint64> keys;
+  int_2dvec_t buckets;
+  for (int n=0; n < nodes_count; n++)
+  {
+    uint64 h = get_node_hash(n, hash_type);
+    int b = index.insert(h, buckets.size());
+    if (b == int(buckets.size()))
+    {
+      keys.push_back(h);
+      buckets.push_back();
+    }
+    buckets[b].push_back(n);
+  }
+
+  // Only keep the hashes shared by at least two nodes
+  for (size_t b=0; b < buckets.size(); b++)
+  {
+    if (buckets[b].size() > 1)
+      node_matches[keys[b]].swap(buckets[b]);
+  }
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::build_succ_index()
+{
+  int nodes_count = succs.size();
+  for (int t=0; t < BBH_FREQ; t++)
+  {
+    qvector<succ_hash_vec_t> &index = succ_hashes[t];
+    index.resize(nodes_count);
+    for (int n=0; n < nodes_count; n++)
+    {
+      nodespan_t n_succs = succs[n];
+      succ_hash_vec_t &sh = index[n];
+      sh.resize(n_succs.size());
+      for (size_t i=0; i < n_succs.size(); i++)
+      {
+        sh[i].hash = get_node_hash(n_succs[i], bbhash_type_t(t));
+        sh[i].pos = int(i);
+      }
+      std::sort(sh.begin(), sh.end());
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+template <bbhash_type_t T>
+bool BBMatcher::find_match_in_succs(
+    bfs_state_t &st,
+    int node1,
+    int parent2,
+    int *scanned2,
+    int *matched,
+    uint64 *label) const
+{
+  // The successors of parent2 are compared in order and every compared
+  // successor is marked as visited once the successors of the current
+  // node are processed. 'scanned2' is the count of compared successors
+  nodespan_t parent_succs = succs[parent2];
+
+  // Only look at the successors with the same hash, in their order
+  const succ_hash_vec_t &sh = succ_hashes[T][parent2];
+  succ_hash_t key;
+  key.hash = get_node_hash(node1, T);
+  key.pos = -1;
+  for (succ_hash_vec_t::const_iterator it=std::upper_bound(sh.begin(), sh.end(), key);
+       it != sh.end() && it->hash == key.hash;
+       ++it)
+  {
+    int m = parent_succs[it->pos];
+    if (   st.visited2[m] == st.epoch
+        || m == parent2
+        || st.in_path2[m] == st.epoch
+        || m == node1)
+    {
+      continue;
+    }
+
+    *scanned2 = qmax(*scanned2, it->pos + 1);
+    *matched = m;
+    *label = key.hash;
+    return true;
+  }
+  *scanned2 = parent_succs.size();
+  return false;
+}
+
+//--------------------------------------------------------------------------
+template <>
+bool BBMatcher::find_match_in_succs<BBH_FREQ>(
+    bfs_state_t &st,
+    int node1,
+    int parent2,
+    int *scanned2,
+    int *matched,
+    uint64 *label) const
+{
+  // The frequency match is fuzzy: compare all the successors
+  nodespan_t parent_succs = succs[parent2];
+  int count = parent_succs.size();
+  for (int i=0; i < count; i++)
+  {
+    int m = parent_succs[i];
+    if (   st.visited2[m] == st.epoch
+        || m == parent2
+        || st.in_path2[m] == st.epoch)
+    {
+      continue;
+    }
+
+    uint64 freq_hash;
+    if (!match(node1, m, BBH_FREQ, &freq_hash) || node1 == m)
+      continue;
+
+    *scanned2 = qmax(*scanned2, i + 1);
+    *matched = m;
+    *label = freq_hash;
+    return true;
+  }
+  *scanned2 = count;
+  return false;
+}
+
+//--------------------------------------------------------------------------
+/**
+* @brief Return the edit distance allowed between two itype sequences
+*/
+static int get_edit_max_dist(int len1, int len2)
+{
+  int len = qmax(len1, len2);
+  if (len < EDIT_MIN_INSNS)
+    return 0;
+
+  return 1 + (len - EDIT_MIN_INSNS) / EDIT_INSNS_PER_EDIT;
+}
+
+//--------------------------------------------------------------------------
+template <>
+bool BBMatcher::find_match_in_succs<BBH_EDIT>(
+    bfs_state_t &st,
+    int node1,
+    int parent2,
+    int *scanned2,
+    int *matched,
+    uint64 *label) const
+{
+  // The pairs already compared by this worker are looked up, and the
+  // itype sequence of node1 is only compiled again for another node
+  const bbfeature_t &f1 = features[node1];
+
+  nodespan_t parent_succs = succs[parent2];
+  int count = parent_succs.size();
+  for (int i=0; i < count; i++)
+  {
+    int m = parent_succs[i];
+    if (   st.visited2[m] == st.epoch
+        || m == parent2
+        || st.in_path2[m] == st.epoch
+        || m == node1)
+    {
+      continue;
+    }
+
+    const bbfeature_t &f2 = features[m];
+    int max_dist = get_edit_max_dist(f1.inst_count, f2.inst_count);
+    if (max_dist == 0)
+      continue;
+
+    uint64 pair = (uint64(uint32(node1)) << 32) | uint32(m);
+    int same = st.edit_pairs.find(pair);
+    if (same == -1)
+    {
+      if (st.edit_node != node1)
+      {
+        st.edit.compile(
+          features.get_itype_ids(node1),
+          f1.inst_count,
+          features.get_itype_count());
+        st.edit_node = node1;
+      }
+
+      same = st.edit.distance(features.get_itype_ids(m), f2.inst_count, max_dist) <= max_dist;
+      st.edit_pairs.insert(pair, same);
+    }
+    if (same == 0)
+      continue;
+
+    // Both orders of the pair get the same label
+    *scanned2 = qmax(*scanned2, i + 1);
+    *matched = m;
+    *label = label_hash(qmin(f1.hash_itype1, f2.hash_itype1), BBH_EDIT);
+    return true;
+  }
+  *scanned2 = count;
+  return false;
+}
+
+//--------------------------------------------------------------------------
+template <bbhash_type_t T, class Next>
+bool BBMatcher::find_match(
+    const match_chain_t<T, Next> &,
+    bfs_state_t &st,
+    int node1,
+    int parent2,
+    int *scanned2,
+    int *matched,
+    uint64 *label) const
+{
+  if (find_match_in_succs<T>(st, node1, parent2, scanned2, matched, label))
+    return true;
+
+  return find_match(Next(), st, node1, parent2, scanned2, matched, label);
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::find_match(
+    const runtime_match_chain_t &,
+    bfs_state_t &st,
+    int node1,
+    int parent2,
+    int *scanned2,
+    int *matched,
+    uint64 *label) const
+{
+  for (size_t i=0; i < match_chain.size(); i++)
+  {
+    bool ok;
+    switch (match_chain[i])
+    {
+      case BBH_ITYPE1:
+        ok = find_match_in_succs<BBH_ITYPE1>(st, node1, parent2, scanned2, matched, label);
+        break;
+      case BBH_ITYPE2:
+        ok = find_match_in_succs<BBH_ITYPE2>(st, node1, parent2, scanned2, matched, label);
+        break;
+      case BBH_EDIT:
+        ok = find_match_in_succs<BBH_EDIT>(st, node1, parent2, scanned2, matched, label);
+        break;
+      default:
+        ok = find_match_in_succs<BBH_FREQ>(st, node1, parent2, scanned2, matched, label);
+        break;
+    }
+    if (ok)
+      return true;
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::set_match_chain(const bbhash_type_t *chain, int count)
+{
+  match_chain.qclear();
+  if (chain == NULL)
+    return;
+
+  for (int i=0; i < count; i++)
+    match_chain.push_back(chain[i]);
+
+  // Use the specialized matcher if this is the default chain
+  static const bbhash_type_t def_chain[] = { BBH_ITYPE1, BBH_ITYPE2, BBH_FREQ };
+  if (   count == qnumber(def_chain)
+      && std::equal(def_chain, def_chain + count, chain))
+  {
+    match_chain.qclear();
+  }
+}
+
+//--------------------------------------------------------------------------
+int BBMatcher::make_subgraph_single_entry_point(
+    bfs_state_t &st,
+    const intvec_t &path1,
+    const intvec_t &path2) const
+{
+  // The nodes are removed from the tail of both paths until no node
+  // other than the head has a predecessor outside of the remaining nodes.
+  // Return the count of remaining nodes
+  int len = path1.size();
+  if (len != int(path2.size()))
+    return 0;
+
+  // Unless it contains the entry block, a prefix where no node other than
+  // the head has an external predecessor is dominated by the head. If the
+  // entry block is not in the path, the first reachable node that is not
+  // dominated by the head bounds the result
+  if (!path1.has(0) || path1[0] == 0)
+  {
+    for (int i=1; i < len; i++)
+    {
+      int n = path1[i];
+      if (doms.is_reachable(n) && !doms.dominates(path1[0], n))
+      {
+        len = i;
+        break;
+      }
+    }
+  }
+
+  for (int i=0; i < len; i++)
+    st.path_pos[path1[i]] = i;
+
+  // Count the predecessors outside of the path of each node
+  intvec_t &ext_preds = st.ext_preds;
+  ext_preds.resize(len);
+  int unclosed = 0;
+  ext_preds[0] = 0;
+  for (int i=1; i < len; i++)
+  {
+    int count = 0;
+    nodespan_t node_preds = preds[path1[i]];
+    for (const int *it=node_preds.begin();
+         it != node_preds.end();
+         ++it)
+    {
+      if (st.path_pos[*it] == -1)
+        ++count;
+    }
+    ext_preds[i] = count;
+    if (count != 0)
+      ++unclosed;
+  }
+
+  // Removing the tail node makes it an external predecessor
+  // of its successors that remain in the path
+  while (unclosed != 0 && len > 1)
+  {
+    --len;
+    if (ext_preds[len] != 0)
+      --unclosed;
+
+    nodespan_t node_succs = succs[path1[len]];
+    for (const int *it=node_succs.begin();
+         it != node_succs.end();
+         ++it)
+    {
+      int p = st.path_pos[*it];
+      if (p > 0 && p < len && ++ext_preds[p] == 1)
+        ++unclosed;
+    }
+  }
+
+  for (size_t i=0; i < path1.size(); i++)
+    st.path_pos[path1[i]] = -1;
+
+  return len;
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::add_path_pair(
+    pathlist_t &paths,
+    const intvec_t &path1,
+    const intvec_t &path2)
+{
+  paths.add_path(path1);
+  paths.add_path(path2);
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::add_path_pair(
+    arena_pathlist_t &paths,
+    const intvec_t &path1,
+    const intvec_t &path2)
+{
+  paths.add_path(full_arena, path1);
+  paths.add_path(full_arena, path2);
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::store_seed_result(seed_result_t &res, path_arena_t &arena) const
+{
+  // The arena spills past the budget while the seeds are still explored
+  res.path_id1 = res.path_id2 = -1;
+  if (keep_similar)
+  {
+    res.full_path_hash1 = hash_path(res.path1);
+    res.full_path_hash2 = hash_path(res.path2);
+    res.path_id1 = arena.add(res.path1, res.full_path_hash1);
+    res.path_id2 = arena.add(res.path2, res.full_path_hash2);
+  }
+  else if (res.bis_len > 1)
+  {
+    // Only the single entry prefixes are needed by the analysis itself
+    res.path1.resize(res.bis_len);
+    res.path2.resize(res.bis_len);
+    res.path_id1 = arena.add(res.path1);
+    res.path_id2 = arena.add(res.path2);
+  }
+  res.path1.qclear();
+  res.path2.qclear();
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::set_arena_budget(
+    const qvector<seed_worker_t> &workers,
+    const qvector<seed_result_ref_vec_t> &pending)
+{
+  // The arena gets what the rest of the exploration leaves of the budget
+  size_t used = selection_size;
+  for (size_t i=0; i < workers.size(); i++)
+  {
+    used += workers[i].results.size() * sizeof(seed_result_t)
+          + workers[i].state.edit_pairs.get_memory_size();
+  }
+  for (size_t len=0; len < pending.size(); len++)
+    used += pending[len].size() * sizeof(seed_result_ref_t);
+
+  full_arena.set_budget(used < memory_budget ? memory_budget - used : 1);
+}
+
+//--------------------------------------------------------------------------
+template <class Chain>
+void BBMatcher::explore_seed_pair(
+    bfs_state_t &st,
+    const seed_pair_t &seed,
+    seed_result_t &res) const
+{
+  // Start a new BFS generation
+  ++st.epoch;
+  if (st.edit_pairs.size() >= EDIT_PAIRS_MAX)
+    st.edit_pairs.clear();
+
+  intvec_t &path1 = res.path1, &path2 = res.path2;
+  path1.qclear();
+  path2.qclear();
+  path1.push_back(seed.node1);
+  path2.push_back(seed.node2);
+  st.in_path1[seed.node1] = st.epoch;
+  st.in_path2[seed.node2] = st.epoch;
+
+  // The hash of each node in path1, in the path order
+  qvector<uint64> labels1;
+  labels1.push_back(get_node_hash(seed.node1, BBH_ITYPE2));
+
+  qvector< std::pair<int, int> > q;
+  q.push_back(std::make_pair(seed.node1, seed.node2));
+
+  for (size_t qhead=0; qhead < q.size(); ++qhead)
+  {
+    int x = q[qhead].first;
+    int y = q[qhead].second;
+
+    int scanned2 = 0;
+    nodespan_t x_succs = succs[x];
+    for (const int *it=x_succs.begin(); it != x_succs.end(); ++it)
+    {
+      int l = *it;
+      if (   st.visited1[l] == st.epoch
+          || l == x
+          || st.in_path1[l] == st.epoch)
+      {
+        continue;
+      }
+      st.visited1[l] = st.epoch;
+
+      // Try the hash types of the chain in order
+      int m;
+      uint64 label;
+      if (!find_match(Chain(), st, l, y, &scanned2, &m, &label))
+        continue;
+
+      labels1.push_back(label);
+      path1.push_back(l);
+      path2.push_back(m);
+      st.in_path1[l] = st.epoch;
+      st.in_path2[m] = st.epoch;
+      st.visited2[m] = st.epoch;
+      q.push_back(std::make_pair(l, m));
+    }
+
+    // Marking the skipped successors too is harmless: they are either
+    // visited already, in path2 or y itself (which is in path2)
+    nodespan_t y_succs = succs[y];
+    for (int i=0; i < scanned2; i++)
+      st.visited2[y_succs[i]] = st.epoch;
+  }
+
+  res.bis_len = make_subgraph_single_entry_point(st, path1, path2);
+
+  // The single entry path hash is chained after the full path hash
+  hash64_t ph;
+  for (size_t i=0; i < labels1.size(); i++)
+    ph.update(labels1[i]);
+  res.full_hash = ph.digest();
+
+  for (int i=0; i < res.bis_len; i++)
+    ph.update(labels1[i]);
+  res.bis_hash = ph.digest();
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::explore_seed_pair(
+    bfs_state_t &st,
+    const seed_pair_t &seed,
+    seed_result_t &res) const
+{
+  if (match_chain.empty())
+    explore_seed_pair<default_match_chain_t>(st, seed, res);
+  else
+    explore_seed_pair<runtime_match_chain_t>(st, seed, res);
+}
+
+//--------------------------------------------------------------------------
+int idaapi BBMatcher::seed_worker_thread(void *ud)
+{
+  seed_worker_t *w = (seed_worker_t *)ud;
+  const seed_pair_vec_t &seeds = *w->seeds;
+
+  size_t first, last;
+  while (   !w->progress->is_cancelled()
+         && w->sched->get_work(w->id, &first, &last))
+  {
+    size_t old_count = w->results.size();
+    for (size_t k=first; k < last; k++)
+    {
+      size_t i = (*w->order)[w->first + k];
+
+      seed_result_t &res = w->results.push_back();
+      res.seed = i;
+      w->matcher->explore_seed_pair(w->state, seeds[i], res);
+
+      // Only keep the seeds that grew into a path
+      if (res.path1.size() < 2)
+      {
+        w->results.pop_back();
+      }
+      else if (w->matcher->memory_budget != 0)
+      {
+        // Nothing is left of a seed that has no path to store
+        w->matcher->store_seed_result(res, *w->arena);
+        if (res.path_id1 == -1)
+          w->results.pop_back();
+      }
+    }
+    w->progress->add_seeds(last - first, w->results.size() - old_count);
+  }
+  return 0;
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::explore_seed_pairs(
+    const seed_pair_vec_t &seeds,
+    const qvector<size_t> &order,
+    size_t first,
+    size_t last,
+    qvector<seed_worker_t> &workers,
+    seed_pool_t &pool)
+{
+  size_t count = last - first;
+  int nworkers = 1;
+  if (count >= MIN_PARALLEL_SEEDS)
+    nworkers = qmin(int(workers.size()), int(count / SEED_CHUNK_SIZE) + 1);
+
+  seed_scheduler_t sched(count, nworkers);
+  for (int i=0; i < nworkers; i++)
+  {
+    seed_worker_t &w = workers[i];
+    w.matcher = this;
+    w.seeds = &seeds;
+    w.sched = &sched;
+    w.progress = &progress;
+    w.id = i;
+    w.order = &order;
+    w.first = first;
+    w.arena = &full_arena;
+  }
+
+  pool.run(nworkers);
+}
+
+//--------------------------------------------------------------------------
+int BBMatcher::get_region_bound(int n) const
+{
+  // The paths only grow along the successors. If the entry block has no
+  // predecessor it can only be a path head, so the nodes of a single
+  // entry path are dominated by its head
+  if (!preds.empty() && preds[0].empty() && doms.is_reachable(n))
+    return doms.get_subtree_size(n);
+
+  return features.size();
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::list_seed_pairs(seed_pair_vec_t &seeds)
+{
+  // List the pairs of nodes with the same hash in the serial order
+  intvec_t order;
+  node_matches.get_sorted_order(order);
+  for (size_t k=0; k < order.size() && !progress.is_cancelled(); k++)
+  {
+    const intvec_t &nodes = node_matches.get_value(order[k]);
+    for (size_t z=0; z + 1 < nodes.size(); z++)
+    {
+      for (size_t j=z+1; j < nodes.size(); j++)
+      {
+        seed_pair_t &seed = seeds.push_back();
+        seed.node_hash = node_matches.get_key(order[k]);
+        seed.node1 = nodes[z];
+        seed.node2 = nodes[j];
+      }
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::list_wl_seed_pairs(seed_pair_vec_t &seeds)
+{
+  // The signature of a node starts as its hash and is refined at each
+  // level with the sorted signatures of its successors. Two nodes with
+  // the same signature at level k root the same labeled successor tree
+  // of depth k, so they are likely the heads of repeated regions
+  int nodes_count = features.size();
+  qvector<uint64> sig, next_sig, succ_sigs;
+  sig.resize(nodes_count);
+  next_sig.resize(nodes_count);
+  for (int n=0; n < nodes_count; n++)
+    sig[n] = get_node_hash(n, BBH_ITYPE2);
+
+  // First node of the deepest signature class of each node that is not
+  // alone in its class
+  intvec_t rep;
+  rep.resize(nodes_count, -1);
+
+  qvector< std::pair<uint64, int> > order;
+  order.resize(nodes_count);
+  size_t prev_classes = 0;
+  for (int level=0; level <= wl_depth; level++)
+  {
+    if (level > 0)
+    {
+      for (int n=0; n < nodes_count; n++)
+      {
+        nodespan_t n_succs = succs[n];
+        succ_sigs.qclear();
+        for (size_t i=0; i < n_succs.size(); i++)
+          succ_sigs.push_back(sig[n_succs[i]]);
+        std::sort(succ_sigs.begin(), succ_sigs.end());
+
+        hash64_t h;
+        h.update(sig[n]);
+        for (size_t i=0; i < succ_sigs.size(); i++)
+          h.update(succ_sigs[i]);
+        next_sig[n] = h.digest();
+      }
+      sig.swap(next_sig);
+    }
+
+    // Group the nodes by signature, in ascending node order in each class
+    for (int n=0; n < nodes_count; n++)
+      order[n] = std::make_pair(sig[n], n);
+    std::sort(order.begin(), order.end());
+
+    size_t classes = 0;
+    for (int i=0, j; i < nodes_count; i = j)
+    {
+      ++classes;
+      for (j=i+1; j < nodes_count && order[j].first == order[i].first; j++)
+        rep[order[j].second] = order[i].second;
+
+      if (j - i > 1)
+        rep[order[i].second] = order[i].second;
+    }
+
+    // Stop once the classes are not split anymore
+    if (classes == prev_classes)
+      break;
+    prev_classes = classes;
+  }
+
+  // Pair the nodes that share the first node of their deepest class.
+  // The classes are small once refined so the pairs count stays low
+  int_2dvec_t groups;
+  groups.resize(nodes_count);
+  for (int n=0; n < nodes_count; n++)
+  {
+    if (rep[n] != -1)
+      groups[rep[n]].push_back(n);
+  }
+
+  for (int r=0; r < nodes_count; r++)
+  {
+    intvec_t &nodes = groups[r];
+    for (size_t z=0; z + 1 < nodes.size(); z++)
+    {
+      for (size_t j=z+1; j < nodes.size(); j++)
+      {
+        seed_pair_t &seed = seeds.push_back();
+        seed.node_hash = get_node_hash(r, BBH_ITYPE2);
+        seed.node1 = nodes[z];
+        seed.node2 = nodes[j];
+      }
+    }
+  }
+  std::sort(seeds.begin(), seeds.end(), seed_pair_less);
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::find_subgraphs()
+{
+  seed_pair_vec_t seeds;
+  if (discovery == BBD_WL_SIGNATURES)
+    list_wl_seed_pairs(seeds);
+  else
+    list_seed_pairs(seeds);
+
+  // Bound the size of the single entry path each seed pair can grow and
+  // explore the seeds by decreasing bound. Only the first path of the pair
+  // is checked for entries
+  intvec_t bounds;
+  bounds.resize(seeds.size());
+  qvector< std::pair<int, size_t> > by_bound;
+  for (size_t i=0; i < seeds.size(); i++)
+  {
+    bounds[i] = get_region_bound(seeds[i].node1);
+    by_bound.push_back(std::make_pair(-bounds[i], i));
+  }
+  std::sort(by_bound.begin(), by_bound.end());
+
+  qvector<size_t> order;
+  order.resize(by_bound.size());
+  for (size_t i=0; i < by_bound.size(); i++)
+    order[i] = by_bound[i].second;
+
+  // Without the full paths, a seed whose head dominates too few nodes for
+  // a group has nothing to contribute: it is not explored at all
+  if (memory_budget != 0 && !keep_similar)
+  {
+    while (!order.empty() && bounds[order.back()] < MIN_FUNC_SIZE_IN_BLOCKS)
+      order.pop_back();
+  }
+  progress.set_seeds_total(order.size());
+
+  int nworkers = qmax(1, nthreads > 0 ? nthreads : get_cpu_count());
+  qvector<seed_worker_t> workers;
+  workers.resize(nworkers);
+  for (int i=0; i < nworkers; i++)
+    workers[i].state.reset(features.size());
+
+  // The worker threads are kept for all the stages
+  seed_pool_t pool(workers, seed_worker_thread);
+
+  // The selection starts over
+  int nodes_count = features.size();
+  selection_size = 0;
+  moved.qclear();
+  moved_per_node.qclear();
+  moved_per_node.resize(nodes_count);
+  selected_len = nodes_count + 1;
+
+  // Single entry paths per length, waiting for all the paths of their length
+  qvector<seed_result_ref_vec_t> pending;
+
+  // The seeds are explored in stages. After a stage, the paths longer than
+  // the bound of the next seed are all known and go through the selection,
+  // so the sink gets the largest groups while the exploration goes on.
+  // When only the largest groups are wanted, the exploration stops as soon
+  // as they are selected: the result is the same as the one of a full run
+  bool done = false;
+  for (size_t first=0; first < order.size() && !done; )
+  {
+    // End the stage on a bound change
+    size_t last = qmin(first + MIN_STAGE_SEEDS, order.size());
+    while (last < order.size() && bounds[order[last]] == bounds[order[last - 1]])
+      ++last;
+
+    intvec_t old_counts;
+    for (int i=0; i < nworkers; i++)
+      old_counts.push_back(int(workers[i].results.size()));
+
+    if (memory_budget != 0)
+      set_arena_budget(workers, pending);
+
+    // A cancelled analysis still keeps the paths of the explored seeds,
+    // FindSimilar() works on them
+    explore_seed_pairs(seeds, order, first, last, workers, pool);
+    if (progress.is_cancelled())
+      break;
+
+    for (int i=0; i < nworkers; i++)
+    {
+      seed_result_vec_t &wr = workers[i].results;
+      for (int j=old_counts[i]; j < int(wr.size()); j++)
+      {
+        int len = wr[j].bis_len;
+        if (len <= 1)
+          continue;
+
+        if (len >= int(pending.size()))
+          pending.resize(len + 1);
+        seed_result_ref_t &ref = pending[len].push_back();
+        ref.seed = wr[j].seed;
+        ref.worker = i;
+        ref.idx = j;
+      }
+    }
+
+    int min_len = last < order.size() ? bounds[order[last]] + 1 : 0;
+    done = select_stage(seeds, workers, pending, min_len);
+    first = last;
+  }
+
+  // Merge the full paths of all the explored seeds in the serial order
+  // so the output does not depend on the thread count
+  qvector<seed_result_t *> results;
+  for (int i=0; i < nworkers; i++)
+  {
+    seed_result_vec_t &wr = workers[i].results;
+    for (size_t j=0; j < wr.size(); j++)
+      results.push_back(&wr[j]);
+  }
+  std::sort(results.begin(), results.end(), seed_result_less);
+
+  for (size_t i=0; i < results.size(); i++)
+  {
+    seed_result_t &res = *results[i];
+    uint64 node_hash = seeds[res.seed].node_hash;
+
+    if (memory_budget == 0)
+    {
+      add_path_pair(
+        path_per_nhash_full.get(pathkey_t(node_hash, res.full_hash)),
+        res.path1,
+        res.path2);
+    }
+    else if (keep_similar)
+    {
+      arena_pathlist_t &paths =
+        path_per_nhash_full.get(pathkey_t(node_hash, res.full_hash));
+      paths.add_id(res.path_id1, res.full_path_hash1);
+      paths.add_id(res.path_id2, res.full_path_hash2);
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::select_stage(
+    const seed_pair_vec_t &seeds,
+    qvector<seed_worker_t> &workers,
+    qvector<seed_result_ref_vec_t> &pending,
+    int min_len)
+{
+  // Merge the single entry paths of 'min_len' nodes or more in the serial
+  // order. All the paths of the same key have the same length
+  size_t first_key = path_per_nhash.size();
+  for (int len=int(pending.size()) - 1; len >= min_len && len > 1; len--)
+  {
+    seed_result_ref_vec_t &refs = pending[len];
+    if (refs.empty())
+      continue;
+
+    std::sort(refs.begin(), refs.end());
+    for (size_t i=0; i < refs.size(); i++)
+    {
+      const seed_result_t &res = workers[refs[i].worker].results[refs[i].idx];
+      // The full paths are still needed by the final merge
+      intvec_t path1, path2;
+      if (memory_budget == 0)
+      {
+        path1 = res.path1;
+        path2 = res.path2;
+      }
+      else
+      {
+        full_arena.get(res.path_id1, path1);
+        full_arena.get(res.path_id2, path2);
+        if (int(path1.size()) < len || int(path2.size()) < len)
+          continue;
+      }
+      path1.resize(len);
+      path2.resize(len);
+
+      pathlist_t &paths =
+        path_per_nhash.get(pathkey_t(seeds[res.seed].node_hash, res.bis_hash));
+      size_t old_size = paths.get_memory_size();
+      add_path_pair(paths, path1, path2);
+      selection_size += paths.get_memory_size() - old_size;
+    }
+
+    seed_result_ref_vec_t empty;
+    refs.swap(empty);
+  }
+
+  sort_by_path_len(first_key);
+  return get_matched_wellformed_functions(qmax(min_len, MIN_FUNC_SIZE_IN_BLOCKS));
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::sort_by_path_len(size_t first_key)
+{
+  intvec_t order;
+  path_per_nhash.get_sorted_order(order, first_key);
+  for (size_t i=0; i < order.size(); i++)
+  {
+    int len = path_per_nhash.get_value(order[i])[0].size();
+    if (len >= int(size_dic.size()))
+      size_dic.resize(len + 1);
+    size_dic[len].push_back(path_per_nhash.get_pathkey(order[i]));
+  }
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::subgraph_has_external_jumps_into_it(
+    const intvec_t &subgraph,
+    const nodeset_t &nodes)
+{
+  for (size_t i=1; i < subgraph.size(); i++)
+  {
+    nodespan_t node_preds = preds[subgraph[i]];
+    for (const int *it=node_preds.begin();
+         it != node_preds.end();
+         ++it)
+    {
+      if (!nodes.has(*it))
+        return true;
+    }
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::subgraph_has_head_size(
+    const intvec_t &subgraph,
+    const nodeset_t &nodes)
+{
+  // Check the first bytes of the subgraph with one batched lookup
+  ea_t start = features[subgraph[0]].start;
+  eavec_t addrs;
+  for (ea_t address = start; address < start + 8; address += 2)
+    addrs.push_back(address);
+
+  intvec_t addr_nodes;
+  features.find_by_addrs(addrs, addr_nodes);
+  for (size_t i=0; i < addr_nodes.size(); i++)
+  {
+    if (addr_nodes[i] == -1 || !nodes.has(addr_nodes[i]))
+      return false;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::get_matched_wellformed_functions(
+    int min_len,
+    int min_func_head_size)
+{
+  int nodes_count = features.size();
+
+  // Resume below the lengths of the previous rounds
+  qvector<nodeset_t> sets;
+  int len = qmin(selected_len, int(size_dic.size())) - 1;
+  for ( ; len >= min_len; len--)
+  {
+    selected_len = len;
+    pathkey_vec_t &keys = size_dic[len];
+    for (pathkey_vec_t::iterator it_key=keys.begin();
+         it_key != keys.end() && !progress.is_cancelled();
+         ++it_key)
+    {
+      int_2dvec_t &paths = path_per_nhash.get(*it_key);
+
+      sets.resize(paths.size());
+      sets[0].create(nodes_count, paths[0]);
+      if (subgraph_has_external_jumps_into_it(paths[0], sets[0]))
+        continue;
+
+      for (size_t j=1; j < paths.size(); j++)
+        sets[j].create(nodes_count, paths[j]);
+
+      // Skip the instances that are fully covered by a selected subgraph.
+      // Such a subgraph contains the head of the instance
+      int_2dvec_t norm;
+      intvec_t norm_idx;
+      for (size_t j=0; j < paths.size(); j++)
+      {
+        intvec_t &candidates = moved_per_node[paths[j][0]];
+
+        bool skip = false;
+        for (intvec_t::iterator it_k=candidates.begin();
+             it_k != candidates.end();
+             ++it_k)
+        {
+          if (sets[j].is_subset_of(moved[*it_k]))
+          {
+            skip = true;
+            break;
+          }
+        }
+        if (!skip)
+        {
+          norm.push_back(paths[j]);
+          norm_idx.push_back(int(j));
+        }
+      }
+
+      if (norm.size() < 2)
+        continue;
+
+      if (min_func_head_size > 0 && !subgraph_has_head_size(norm[0], sets[norm_idx[0]]))
+        continue;
+
+      for (size_t j=0; j < norm.size(); j++)
+      {
+        int k = moved.size();
+        moved.push_back(sets[norm_idx[j]]);
+        for (intvec_t::iterator it_n=norm[j].begin();
+             it_n != norm[j].end();
+             ++it_n)
+        {
+          moved_per_node[*it_n].push_back(k);
+        }
+      }
+      normalized.push_back(norm);
+      if (sink != NULL)
+        sink->add_group(norm);
+
+      if (max_groups > 0 && int(normalized.size()) >= max_groups)
+        return true;
+    }
+    if (progress.is_cancelled())
+      break;
+
+    // No path of this length is added later: free the lists
+    for (pathkey_vec_t::iterator it_key=keys.begin();
+         it_key != keys.end();
+         ++it_key)
+    {
+      pathlist_t &paths = path_per_nhash.get(*it_key);
+      selection_size -= paths.get_memory_size();
+      paths.release();
+    }
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::Prepare(qflow_chart_t &fc)
+{
+  clear();
+  progress.reset();
+
+  build_graph(fc);
+  doms.build(succs, preds, 0);
+  features.build(fc);
+  build_succ_index();
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::Run(int_3dvec_t &result)
+{
+  result.qclear();
+
+  hash_bb_match(BBH_ITYPE2);
+  find_subgraphs();
+  build_similar_index();
+  if (progress.is_cancelled())
+    return false;
+
+  result = normalized;
+  return true;
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::Analyze(qflow_chart_t &fc, int_3dvec_t &result)
+{
+  Prepare(fc);
+  return Run(result);
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::Analyze(ea_t func_addr, int_3dvec_t &result)
+{
+  qflow_chart_t fc;
+  if (!get_func_flowchart(func_addr, fc))
+    return false;
+
+  return Analyze(fc, result);
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::build_similar_index()
+{
+  int nodes_count = features.size();
+  head_paths.resize(nodes_count);
+
+  // With a memory budget the node positions are found by decoding the
+  // paths on demand instead
+  bool index_nodes = memory_budget == 0;
+  if (index_nodes)
+    node_paths.resize(nodes_count);
+
+  // The paths are numbered in the order FindSimilar() looks them up
+  intvec_t nodes, order;
+  path_per_nhash_full.get_sorted_order(order);
+  for (size_t k=0; k < order.size(); k++)
+  {
+    const arena_pathlist_t &paths = path_per_nhash_full.get_value(order[k]);
+    for (size_t i=0; i < paths.size(); i++)
+    {
+      int path = full_paths.size();
+      pathref_t &ref = full_paths.push_back();
+      ref.paths = &paths;
+      ref.idx = int(i);
+
+      full_arena.get(paths.get_id(i), nodes);
+      head_paths[nodes[0]].push_back(path);
+      if (!index_nodes)
+        continue;
+
+      for (size_t pos=0; pos < nodes.size(); pos++)
+      {
+        nodepos_t &np = node_paths[nodes[pos]].push_back();
+        np.path = path;
+        np.pos = int(pos);
+      }
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+int BBMatcher::get_node_pos(int n, int path) const
+{
+  const nodepos_vec_t &occ = node_paths[n];
+  nodepos_t key;
+  key.path = path;
+  key.pos = 0;
+  nodepos_vec_t::const_iterator it = std::lower_bound(
+    occ.begin(),
+    occ.end(),
+    key,
+    nodepos_less);
+
+  return it != occ.end() && it->path == path ? it->pos : -1;
+}
+
+//--------------------------------------------------------------------------
+bool BBMatcher::FindSimilar(intvec_t &node_list, int_2dvec_t &similar)
+{
+  similar.qclear();
+
+  int nodes_count = features.size();
+  for (intvec_t::iterator it=node_list.begin(); it != node_list.end(); ++it)
+  {
+    if (*it < 0 || *it >= nodes_count)
+      return false;
+  }
+
+  size_t size = node_list.size();
+  if (size == 0)
+    return false;
+
+  // The path index is only built by a finished or cancelled Run()
+  if (head_paths.size() != size_t(nodes_count))
+    return false;
+
+  // A single node: return all the nodes with the same hash
+  if (size == 1)
+  {
+    const intvec_t *nodes = node_matches.find(
+      get_node_hash(node_list[0], BBH_ITYPE2));
+    if (nodes == NULL)
+      return false;
+
+    for (intvec_t::const_iterator it_n=nodes->begin();
+         it_n != nodes->end();
+         ++it_n)
+    {
+      similar.push_back().push_back(*it_n);
+    }
+    return true;
+  }
+
+  pathlist_t found;
+  intvec_t match_index, nodes, other;
+  for (intvec_t::iterator it_head=node_list.begin();
+       it_head != node_list.end();
+       ++it_head)
+  {
+    // Walk the paths starting with this node. Only the first path of
+    // each path list that contains all the input nodes is used
+    const arena_pathlist_t *done = NULL;
+    intvec_t &heads = head_paths[*it_head];
+    for (intvec_t::iterator it_p=heads.begin(); it_p != heads.end(); ++it_p)
+    {
+      const pathref_t &ref = full_paths[*it_p];
+      const arena_pathlist_t &paths = *ref.paths;
+      if (   &paths == done
+          || int(size) > full_arena.get_path_size(paths.get_id(0)))
+      {
+        continue;
+      }
+
+      // Get the position of each input node in the matched path
+      bool indexed = !node_paths.empty();
+      if (!indexed)
+        full_arena.get(paths.get_id(ref.idx), nodes);
+
+      match_index.qclear();
+      for (intvec_t::iterator it_n=node_list.begin();
+           it_n != node_list.end();
+           ++it_n)
+      {
+        int pos;
+        if (indexed)
+        {
+          pos = get_node_pos(*it_n, *it_p);
+        }
+        else
+        {
+          intvec_t::iterator it_pos = nodes.find(*it_n);
+          pos = it_pos == nodes.end() ? -1 : int(it_pos - nodes.begin());
+        }
+        if (pos == -1)
+          break;
+        match_index.push_back(pos);
+      }
+      if (match_index.size() != size)
+        continue;
+
+      // Get the subsets from each path that matches the input node list
+      for (size_t j=0; j < paths.size(); j++)
+      {
+        full_arena.get(paths.get_id(j), other);
+
+        intvec_t subset;
+        for (size_t i=0; i < size && match_index[i] < int(other.size()); i++)
+          subset.push_back(other[match_index[i]]);
+
+        if (subset.size() == size)
+          found.add_path(subset);
+      }
+      done = &paths;
+    }
+    if (!found.empty())
+    {
+      similar.swap(found);
+      return true;
+    }
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------------
+void BBMatcher::Canonicalize(int_3dvec_t &result)
+{
+  for (int_3dvec_t::iterator it=result.begin(); it != result.end(); ++it)
+    std::sort(it->begin(), it->end(), intvec_less);
+
+  std::sort(result.begin(), result.end(), int_2dvec_less);
+}
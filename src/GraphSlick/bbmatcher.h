@@ -0,0 +1,887 @@
+#ifndef __BBMATCHER__
+#define __BBMATCHER__
+
+/*--------------------------------------------------------------------------
+GraphSlick (c) Elias Bachaalany
+-------------------------------------
+
+Native BBMatcher
+
+This module is a C++ implementation of the bbMatcherClass found in
+bb_match.py. It works directly on the function flowchart and a per-block
+feature table, and produces the same results as PyBBMatcher
+
+--------------------------------------------------------------------------*/
+
+//--------------------------------------------------------------------------
+#include <pro.h>
+#include <gdl.hpp>
+#include "types.hpp"
+#include "bbfeatures.h"
+#include "hashtab.h"
+#include "domtree.h"
+#include "bbgraph.h"
+#include "patharena.h"
+
+//--------------------------------------------------------------------------
+/**
+* @brief The hash types used to match two blocks
+*/
+enum bbhash_type_t
+{
+  BBH_ITYPE1,
+  BBH_ITYPE2,
+  BBH_FREQ,
+
+  // Itype sequences within a small edit distance (not in the default chain)
+  BBH_EDIT,
+};
+
+//--------------------------------------------------------------------------
+// Minimum count of blocks of a wellformed function instance
+#define MIN_FUNC_SIZE_IN_BLOCKS 4
+
+//--------------------------------------------------------------------------
+/**
+* @brief How find_subgraphs() picks the seed pairs it grows paths from
+*/
+enum bbdiscovery_t
+{
+  // All the pairs of nodes with the same hash (quadratic per hash)
+  BBD_SEED_PAIRS,
+
+  // Only pair the nodes of the same Weisfeiler-Lehman signature class,
+  // taken at the deepest level where the node is not alone in its class
+  BBD_WL_SIGNATURES,
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief End of a match strategy chain
+*/
+struct match_chain_end_t
+{
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Match strategy chain known at compile time: try the hash type T,
+*        then the rest of the chain. The matcher is specialized for it
+*/
+template <bbhash_type_t T, class Next = match_chain_end_t>
+struct match_chain_t
+{
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief The default chain: from the most to the least strict hash type
+*/
+typedef match_chain_t<BBH_ITYPE1,
+        match_chain_t<BBH_ITYPE2,
+        match_chain_t<BBH_FREQ> > > default_match_chain_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Match strategy chain set with BBMatcher::set_match_chain()
+*/
+struct runtime_match_chain_t
+{
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Hash of a successor and its position in the successor list
+*/
+struct succ_hash_t
+{
+  uint64 hash;
+  int pos;
+
+  bool operator<(const succ_hash_t &o) const
+  {
+    return hash < o.hash || (hash == o.hash && pos < o.pos);
+  }
+};
+typedef qvector<succ_hash_t> succ_hash_vec_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief List of unique paths. The paths are indexed by the hash of their
+*        node sequence and are only compared when the hashes collide
+*/
+class pathlist_t: public int_2dvec_t
+{
+  /**
+  * @brief Node sequence hash -> first path with that hash
+  */
+  digest_index_t index;
+
+  /**
+  * @brief Next path with the same hash or -1
+  */
+  intvec_t next;
+
+  /**
+  * @brief Count of bytes used by the paths
+  */
+  size_t paths_size;
+
+public:
+  pathlist_t(): paths_size(0)
+  {
+  }
+
+  /**
+  * @brief Append a path if it is not in the list yet.
+  *        Return true if the path was added
+  */
+  bool add_path(const intvec_t &path);
+
+  /**
+  * @brief Remove the paths and free their memory
+  */
+  void release();
+
+  /**
+  * @brief Return the count of bytes used by the paths and their index
+  */
+  size_t get_memory_size() const
+  {
+    return paths_size + next.size() * sizeof(int) + index.get_memory_size();
+  }
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Set of node ids stored as a bitmap sized to the flowchart
+*/
+class nodeset_t
+{
+  qvector<uint64> words;
+
+  /**
+  * @brief Range of the words that may have bits set
+  */
+  int lo, hi;
+
+public:
+  nodeset_t(): lo(0), hi(0)
+  {
+  }
+
+  /**
+  * @brief Build the set from a node list
+  */
+  void create(int nodes_count, const intvec_t &nodes);
+
+  /**
+  * @brief Check if a node is in the set
+  */
+  bool has(int n) const
+  {
+    return (words[n >> 6] & (1ULL << (n & 63))) != 0;
+  }
+
+  /**
+  * @brief Check if all the nodes of this set are in another set
+  *        created with the same nodes count
+  */
+  bool is_subset_of(const nodeset_t &other) const;
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Node hash -> list of matching node ids (M)
+*/
+typedef digest_map_t<intvec_t> nodehash2nodes_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief A (node hash, path hash) pair identifying a list of matched paths
+*/
+struct pathkey_t
+{
+  uint64 node_hash;
+  uint64 path_hash;
+
+  pathkey_t(uint64 nh = 0, uint64 ph = 0): node_hash(nh), path_hash(ph)
+  {
+  }
+
+  /**
+  * @brief Digest of both hashes, used as the key of the flat tables
+  */
+  uint64 digest() const
+  {
+    hash64_t h;
+    h.update(node_hash);
+    h.update(path_hash);
+    return h.digest();
+  }
+
+  bool operator<(const pathkey_t &o) const
+  {
+    return node_hash < o.node_hash
+        || (node_hash == o.node_hash && path_hash < o.path_hash);
+  }
+};
+typedef qvector<pathkey_t> pathkey_vec_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Flat map from a path key to a value. It replaces the two levels
+*        of dictionaries (node hash, then path hash) of the Python matcher
+*/
+template <class T>
+class pathkey_map_t
+{
+  digest_map_t<T> map;
+
+  /**
+  * @brief Path key of each entry of the map
+  */
+  pathkey_vec_t pathkeys;
+
+public:
+  size_t size() const
+  {
+    return pathkeys.size();
+  }
+
+  void clear()
+  {
+    map.clear();
+    pathkeys.qclear();
+  }
+
+  /**
+  * @brief Return the value of a key, inserting a default one if needed
+  */
+  T &get(const pathkey_t &key)
+  {
+    size_t count = map.size();
+    T &value = map[key.digest()];
+    if (map.size() != count)
+      pathkeys.push_back(key);
+    return value;
+  }
+
+  /**
+  * @brief Access the i-th entry in insertion order
+  */
+  const pathkey_t &get_pathkey(size_t i) const
+  {
+    return pathkeys[i];
+  }
+
+  T &get_value(size_t i)
+  {
+    return map.get_value(i);
+  }
+
+  /**
+  * @brief Get the indices of the entries added since 'first' ordered by
+  *        node hash then path hash
+  */
+  void get_sorted_order(intvec_t &order, size_t first = 0) const
+  {
+    qvector< std::pair<pathkey_t, int> > sorted;
+    for (size_t i=first; i < pathkeys.size(); i++)
+      sorted.push_back(std::make_pair(pathkeys[i], int(i)));
+    std::sort(sorted.begin(), sorted.end());
+
+    order.resize(sorted.size());
+    for (size_t i=0; i < sorted.size(); i++)
+      order[i] = sorted[i].second;
+  }
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Node hash -> path hash -> list of matched paths (pathPerNodeHash)
+*/
+typedef pathkey_map_t<pathlist_t> nodehash2paths_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Node hash -> path hash -> list of packed paths (pathPerNodeHashFull)
+*/
+typedef pathkey_map_t<arena_pathlist_t> nodehash2arena_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Path length -> path keys (size_dic)
+*/
+typedef qvector<pathkey_vec_t> size2pathkeys_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief A path of a path list
+*/
+struct pathref_t
+{
+  const arena_pathlist_t *paths;
+  int idx;
+};
+typedef qvector<pathref_t> pathref_vec_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Occurrence of a node in an indexed path
+*/
+struct nodepos_t
+{
+  /**
+  * @brief Index of the path in the indexed paths
+  */
+  int path;
+
+  /**
+  * @brief Position of the node in the path
+  */
+  int pos;
+};
+typedef qvector<nodepos_t> nodepos_vec_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Two nodes with the same hash from which a path pair is grown
+*/
+struct seed_pair_t
+{
+  uint64 node_hash;
+  int node1;
+  int node2;
+};
+typedef qvector<seed_pair_t> seed_pair_vec_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Path pair grown from a seed pair
+*/
+struct seed_result_t
+{
+  /**
+  * @brief Index of the seed pair in the serial exploration order
+  */
+  size_t seed;
+
+  intvec_t path1, path2;
+
+  /**
+  * @brief Length of the single entry point prefix of the paths
+  */
+  int bis_len;
+
+  /**
+  * @brief Hash of the full paths and of the single entry point prefix
+  */
+  uint64 full_hash, bis_hash;
+
+  /**
+  * @brief When the memory is bounded: arena indices of the paths and the
+  *        hash_path() of the full paths. The single entry prefix is the
+  *        start of the full path, so only the full paths are stored when
+  *        they are kept and only the prefixes otherwise (-1 if it has less
+  *        than 2 nodes). path1 and path2 are then empty
+  */
+  int path_id1, path_id2;
+  uint64 full_path_hash1, full_path_hash2;
+};
+typedef qvector<seed_result_t> seed_result_vec_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Result of a seed worker, ordered by the serial index of its seed
+*/
+struct seed_result_ref_t
+{
+  size_t seed;
+  int worker;
+  int idx;
+
+  bool operator<(const seed_result_ref_t &o) const
+  {
+    return seed < o.seed;
+  }
+};
+typedef qvector<seed_result_ref_t> seed_result_ref_vec_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Per worker BFS state. A node is marked if its stamp equals 'epoch'
+*/
+struct bfs_state_t
+{
+  intvec_t visited1, visited2, in_path1, in_path2;
+  int epoch;
+
+  /**
+  * @brief Position of each node in the path being pruned or -1
+  */
+  intvec_t path_pos;
+
+  /**
+  * @brief Count of external predecessors per path position
+  */
+  intvec_t ext_preds;
+
+  /**
+  * @brief Compiled itype sequence of 'edit_node', the last node matched
+  *        by edit distance
+  */
+  edit_pattern_t edit;
+  int edit_node;
+
+  /**
+  * @brief Node pair -> 1 if the pair matches by edit distance, 0 if not.
+  *        The cache is cleared between two seeds once it is full
+  */
+  digest_index_t edit_pairs;
+
+  bfs_state_t(): epoch(0), edit_node(-1)
+  {
+  }
+
+  void reset(int nodes_count);
+};
+
+struct seed_worker_t;
+class seed_pool_t;
+
+//--------------------------------------------------------------------------
+/**
+* @brief Receives the wellformed function groups while Analyze() selects
+*        them, from the largest to the smallest. The largest groups arrive
+*        while the seed pairs are still explored. Called from the thread
+*        that runs the analysis
+*/
+class bbgroup_sink_t
+{
+public:
+  virtual ~bbgroup_sink_t()
+  {
+  }
+
+  virtual void add_group(const int_2dvec_t &group) = 0;
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Progress counters and cancellation token of an analysis.
+*        Shared by the thread running Analyze() and the one showing it
+*/
+class bbprogress_t
+{
+  size_t seeds_total, seeds_done, paths_found;
+  volatile bool cancelled;
+  qmutex_t lock;
+
+  // Not copyable
+  bbprogress_t(const bbprogress_t &);
+  bbprogress_t &operator=(const bbprogress_t &);
+
+public:
+  bbprogress_t();
+  ~bbprogress_t();
+
+  /**
+  * @brief Clear the counters and the cancellation request
+  */
+  void reset();
+
+  /**
+  * @brief Ask the running analysis to stop as soon as possible
+  */
+  void cancel()
+  {
+    cancelled = true;
+  }
+
+  bool is_cancelled() const
+  {
+    return cancelled;
+  }
+
+  void set_seeds_total(size_t count);
+
+  /**
+  * @brief Account for explored seed pairs and the paths they grew
+  */
+  void add_seeds(size_t count, size_t paths);
+
+  /**
+  * @brief Get a snapshot of the counters
+  */
+  void get(size_t *total, size_t *done, size_t *paths);
+};
+
+//--------------------------------------------------------------------------
+class BBMatcher
+{
+  /**
+  * @brief Deduplicated successors and predecessors of each node
+  */
+  adjlist_t succs, preds;
+
+  /**
+  * @brief Dominator tree rooted at the entry block
+  */
+  domtree_t doms;
+
+  /**
+  * @brief Per node features
+  */
+  bbfeature_table_t features;
+
+  /**
+  * @brief Per exact hash type: the successors of each node sorted by hash
+  */
+  qvector<succ_hash_vec_t> succ_hashes[BBH_FREQ];
+
+  /**
+  * @brief Hash type 2 -> matching nodes
+  */
+  nodehash2nodes_t node_matches;
+
+  /**
+  * @brief Single entry paths matched per seed node hash
+  */
+  nodehash2paths_t path_per_nhash;
+
+  /**
+  * @brief Paths matched per seed node hash regardless of entries.
+  *        Only FindSimilar() uses them
+  */
+  nodehash2arena_t path_per_nhash_full;
+
+  /**
+  * @brief Storage of the paths of path_per_nhash_full and, when the memory
+  *        is bounded, of the paths of the explored seeds
+  */
+  path_arena_t full_arena;
+
+  /**
+  * @brief Count of bytes used by the lists of path_per_nhash
+  */
+  size_t selection_size;
+
+  /**
+  * @brief Path length -> path keys
+  */
+  size2pathkeys_t size_dic;
+
+  /**
+  * @brief The paths of path_per_nhash_full in the lookup order
+  */
+  pathref_vec_t full_paths;
+
+  /**
+  * @brief Node -> occurrences in full_paths, sorted by path index.
+  *        Not built when the memory is bounded
+  */
+  qvector<nodepos_vec_t> node_paths;
+
+  /**
+  * @brief Node -> indices of the full_paths starting with the node
+  */
+  int_2dvec_t head_paths;
+
+  /**
+  * @brief Well formed functions instances in the order they were selected
+  */
+  int_3dvec_t normalized;
+
+  /**
+  * @brief The node sets of the selected instances, the indices of the sets
+  *        containing each node and the last path length selected from
+  */
+  qvector<nodeset_t> moved;
+  int_2dvec_t moved_per_node;
+  int selected_len;
+
+  /**
+  * @brief Number of threads used to explore the seed pairs (0 = one per CPU)
+  */
+  int nthreads;
+
+  /**
+  * @brief Custom match strategy chain or empty for the default one
+  */
+  qvector<bbhash_type_t> match_chain;
+
+  /**
+  * @brief Seed pairs discovery engine and WL refinement depth
+  */
+  bbdiscovery_t discovery;
+  int wl_depth;
+
+  /**
+  * @brief Maximum count of wellformed function groups (0 = no limit)
+  */
+  int max_groups;
+
+  /**
+  * @brief Optional receiver of the groups as they are selected
+  */
+  bbgroup_sink_t *sink;
+
+  /**
+  * @brief Bytes of paths kept in memory (0 = no limit) and whether the
+  *        full paths are kept at all in that mode
+  */
+  size_t memory_budget;
+  bool keep_similar;
+
+  /**
+  * @brief Progress of the current analysis
+  */
+  bbprogress_t progress;
+
+  void build_graph(qflow_chart_t &fc);
+
+  uint64 get_node_hash(int n, bbhash_type_t hash_type) const;
+
+  bool match(
+      int n1,
+      int n2,
+      bbhash_type_t hash_type,
+      uint64 *freq_hash = NULL) const;
+
+  void hash_bb_match(bbhash_type_t hash_type);
+
+  void build_succ_index();
+
+  template <bbhash_type_t T>
+  bool find_match_in_succs(
+      bfs_state_t &st,
+      int node1,
+      int parent2,
+      int *scanned2,
+      int *matched,
+      uint64 *label) const;
+
+  template <bbhash_type_t T, class Next>
+  bool find_match(
+      const match_chain_t<T, Next> &,
+      bfs_state_t &st,
+      int node1,
+      int parent2,
+      int *scanned2,
+      int *matched,
+      uint64 *label) const;
+
+  bool find_match(
+      const match_chain_end_t &,
+      bfs_state_t &,
+      int,
+      int,
+      int *,
+      int *,
+      uint64 *) const
+  {
+    return false;
+  }
+
+  bool find_match(
+      const runtime_match_chain_t &,
+      bfs_state_t &st,
+      int node1,
+      int parent2,
+      int *scanned2,
+      int *matched,
+      uint64 *label) const;
+
+  int make_subgraph_single_entry_point(
+      bfs_state_t &st,
+      const intvec_t &path1,
+      const intvec_t &path2) const;
+
+  void add_path_pair(
+      pathlist_t &paths,
+      const intvec_t &path1,
+      const intvec_t &path2);
+
+  void add_path_pair(
+      arena_pathlist_t &paths,
+      const intvec_t &path1,
+      const intvec_t &path2);
+
+  void store_seed_result(seed_result_t &res, path_arena_t &arena) const;
+
+  void set_arena_budget(
+      const qvector<seed_worker_t> &workers,
+      const qvector<seed_result_ref_vec_t> &pending);
+
+  template <class Chain>
+  void explore_seed_pair(
+      bfs_state_t &st,
+      const seed_pair_t &seed,
+      seed_result_t &res) const;
+
+  void explore_seed_pair(
+      bfs_state_t &st,
+      const seed_pair_t &seed,
+      seed_result_t &res) const;
+
+  static int idaapi seed_worker_thread(void *ud);
+
+  int get_region_bound(int n) const;
+
+  void explore_seed_pairs(
+      const seed_pair_vec_t &seeds,
+      const qvector<size_t> &order,
+      size_t first,
+      size_t last,
+      qvector<seed_worker_t> &workers,
+      seed_pool_t &pool);
+
+  void list_seed_pairs(seed_pair_vec_t &seeds);
+
+  void list_wl_seed_pairs(seed_pair_vec_t &seeds);
+
+  void find_subgraphs();
+
+  bool select_stage(
+      const seed_pair_vec_t &seeds,
+      qvector<seed_worker_t> &workers,
+      qvector<seed_result_ref_vec_t> &pending,
+      int min_len);
+
+  void sort_by_path_len(size_t first_key);
+
+  void build_similar_index();
+
+  int get_node_pos(int n, int path) const;
+
+  bool subgraph_has_external_jumps_into_it(
+      const intvec_t &subgraph,
+      const nodeset_t &nodes);
+
+  bool subgraph_has_head_size(const intvec_t &subgraph, const nodeset_t &nodes);
+
+  bool get_matched_wellformed_functions(
+      int min_len,
+      int min_func_head_size = 0);
+
+public:
+  BBMatcher(): selection_size(0), selected_len(0), nthreads(0), discovery(BBD_SEED_PAIRS), wl_depth(3),
+               max_groups(0), sink(NULL), memory_budget(0), keep_similar(true)
+  {
+  }
+
+  /**
+  * @brief Set the number of threads used by Analyze(). 0 means one per CPU
+  */
+  void set_threads(int n)
+  {
+    nthreads = n;
+  }
+
+  /**
+  * @brief Set the hash types tried in order to match the successors of two
+  *        matched nodes. The default chain is used if 'chain' is NULL
+  */
+  void set_match_chain(const bbhash_type_t *chain, int count);
+
+  /**
+  * @brief Only look for the 'count' largest wellformed function groups
+  *        (0 = all of them). The groups are the first ones a full analysis
+  *        selects. The exploration stops once they are known, so the paths
+  *        FindSimilar() knows about are incomplete in this mode. When the
+  *        entry block has predecessors the seeds cannot be bounded and all
+  *        of them are explored
+  */
+  void set_max_groups(int count)
+  {
+    max_groups = count;
+  }
+
+  /**
+  * @brief Bound the memory used by the paths of the analysis (0 = no
+  *        limit). The per seed results, the selection lists and the edit
+  *        match caches are counted and the packed paths get the rest: past
+  *        it they are moved to a temporary file. If 'keep_similar_paths'
+  *        is false the full paths FindSimilar() needs are not stored at all
+  *        and it only handles single nodes
+  */
+  void set_memory_budget(size_t bytes, bool keep_similar_paths = true)
+  {
+    memory_budget = bytes;
+    keep_similar = keep_similar_paths;
+    full_arena.set_budget(bytes);
+  }
+
+  /**
+  * @brief Select the seed pairs discovery engine. 'depth' is the maximum
+  *        count of WL refinement rounds
+  */
+  void set_discovery(bbdiscovery_t engine, int depth = 3)
+  {
+    discovery = engine;
+    wl_depth = depth;
+  }
+
+  /**
+  * @brief Publish the selected groups to 'group_sink' (NULL to stop)
+  */
+  void set_sink(bbgroup_sink_t *group_sink)
+  {
+    sink = group_sink;
+  }
+
+  /**
+  * @brief Progress of the running analysis. It can be read and cancelled
+  *        from another thread
+  */
+  bbprogress_t &get_progress()
+  {
+    return progress;
+  }
+
+  /**
+  * @brief Clear the state of the previous analysis
+  */
+  void clear();
+
+  /**
+  * @brief First step of Analyze(): build the graph and decode the features
+  *        of the blocks. It calls the database, so it must run on the main
+  *        thread
+  */
+  void Prepare(qflow_chart_t &fc);
+
+  /**
+  * @brief Second step of Analyze(): match the prepared graph. It does not
+  *        call the database and can run on a separate thread.
+  *        Return false if the analysis was cancelled. FindSimilar() then
+  *        only knows the paths of the seeds explored before the cancellation
+  */
+  bool Run(int_3dvec_t &result);
+
+  /**
+  * @brief Analyze and return the non-overlapping wellformed function instances.
+  *        Return false if the analysis was cancelled
+  */
+  bool Analyze(qflow_chart_t &fc, int_3dvec_t &result);
+
+  /**
+  * @brief Analyze the function at the given address
+  */
+  bool Analyze(ea_t func_addr, int_3dvec_t &result);
+
+  /**
+  * @brief Find the node lists similar to the given one in the last analysis.
+  *        Return false if no analysis ran since the last Prepare()
+  */
+  bool FindSimilar(intvec_t &node_list, int_2dvec_t &similar);
+
+  /**
+  * @brief Sort an Analyze() result so results from both matchers
+  *        can be compared
+  */
+  static void Canonicalize(int_3dvec_t &result);
+};
+
+#endif
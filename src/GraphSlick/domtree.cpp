@@ -0,0 +1,182 @@
+#include "domtree.h"
+
+/*--------------------------------------------------------------------------
+
+The semi-dominators are computed in reverse DFS order and the immediate
+dominators derived from them (Lengauer-Tarjan, simple version with path
+compression). The DFS and the path compression are iterative so deep
+flowcharts do not overflow the stack
+
+--------------------------------------------------------------------------*/
+
+//--------------------------------------------------------------------------
+/**
+* @brief Working state of the Lengauer-Tarjan algorithm.
+*        The nodes are referred to by their DFS number
+*/
+struct lt_state_t
+{
+  intvec_t vertex, parent, semi, label, ancestor, dom;
+  intvec_t bucket_head, bucket_next;
+  intvec_t stack;
+
+  /**
+  * @brief Compress the ancestors path of v so that label[v] is the node
+  *        with the smallest semi-dominator on it
+  */
+  void compress(int v)
+  {
+    stack.qclear();
+    for (int x=v; ancestor[ancestor[x]] != -1; x = ancestor[x])
+      stack.push_back(x);
+
+    while (!stack.empty())
+    {
+      int x = stack.back();
+      stack.pop_back();
+
+      int a = ancestor[x];
+      if (semi[label[a]] < semi[label[x]])
+        label[x] = label[a];
+      ancestor[x] = ancestor[a];
+    }
+  }
+
+  int eval(int v)
+  {
+    if (ancestor[v] == -1)
+      return v;
+
+    compress(v);
+    return label[v];
+  }
+};
+
+//--------------------------------------------------------------------------
+void domtree_t::build(
+    const adjlist_t &succs,
+    const adjlist_t &preds,
+    int root)
+{
+  int nodes_count = succs.size();
+  clear();
+  idom.resize(nodes_count, -1);
+  tin.resize(nodes_count, -1);
+  tout.resize(nodes_count, -1);
+  if (root < 0 || root >= nodes_count)
+    return;
+
+  // Number the reachable nodes in DFS preorder
+  intvec_t dfnum;
+  dfnum.resize(nodes_count, -1);
+
+  lt_state_t lt;
+  qvector< std::pair<int, size_t> > dfs;
+  dfnum[root] = 0;
+  lt.vertex.push_back(root);
+  lt.parent.push_back(-1);
+  dfs.push_back(std::make_pair(root, size_t(0)));
+  while (!dfs.empty())
+  {
+    int n = dfs.back().first;
+    size_t &i = dfs.back().second;
+    if (i == succs[n].size())
+    {
+      dfs.pop_back();
+      continue;
+    }
+
+    int s = succs[n][i++];
+    if (dfnum[s] != -1)
+      continue;
+
+    dfnum[s] = lt.vertex.size();
+    lt.vertex.push_back(s);
+    lt.parent.push_back(dfnum[n]);
+    dfs.push_back(std::make_pair(s, size_t(0)));
+  }
+
+  int count = lt.vertex.size();
+  lt.semi.resize(count);
+  lt.label.resize(count);
+  lt.ancestor.resize(count, -1);
+  lt.dom.resize(count, -1);
+  lt.bucket_head.resize(count, -1);
+  lt.bucket_next.resize(count, -1);
+  for (int v=0; v < count; v++)
+  {
+    lt.semi[v] = v;
+    lt.label[v] = v;
+  }
+
+  for (int w=count-1; w > 0; w--)
+  {
+    // Compute the semi-dominator of w
+    nodespan_t w_preds = preds[lt.vertex[w]];
+    for (size_t i=0; i < w_preds.size(); i++)
+    {
+      int v = dfnum[w_preds[i]];
+      if (v == -1)
+        continue;
+
+      int u = lt.eval(v);
+      if (lt.semi[u] < lt.semi[w])
+        lt.semi[w] = lt.semi[u];
+    }
+    lt.bucket_next[w] = lt.bucket_head[lt.semi[w]];
+    lt.bucket_head[lt.semi[w]] = w;
+
+    // Link w to its parent and implicitly define the immediate
+    // dominators of the nodes whose semi-dominator is the parent
+    int p = lt.parent[w];
+    lt.ancestor[w] = p;
+    for (int v=lt.bucket_head[p]; v != -1; v = lt.bucket_next[v])
+    {
+      int u = lt.eval(v);
+      lt.dom[v] = lt.semi[u] < lt.semi[v] ? u : p;
+    }
+    lt.bucket_head[p] = -1;
+  }
+
+  // Explicitly define the immediate dominators
+  for (int w=1; w < count; w++)
+  {
+    if (lt.dom[w] != lt.semi[w])
+      lt.dom[w] = lt.dom[lt.dom[w]];
+    idom[lt.vertex[w]] = lt.vertex[lt.dom[w]];
+  }
+
+  // Walk the tree to number the nodes for the dominance queries
+  int_2dvec_t children;
+  children.resize(nodes_count);
+  for (int w=1; w < count; w++)
+    children[idom[lt.vertex[w]]].push_back(lt.vertex[w]);
+
+  int t = 0;
+  dfs.qclear();
+  tin[root] = t++;
+  dfs.push_back(std::make_pair(root, size_t(0)));
+  while (!dfs.empty())
+  {
+    int n = dfs.back().first;
+    size_t &i = dfs.back().second;
+    if (i == children[n].size())
+    {
+      tout[n] = t++;
+      dfs.pop_back();
+      continue;
+    }
+
+    int c = children[n][i++];
+    tin[c] = t++;
+    dfs.push_back(std::make_pair(c, size_t(0)));
+  }
+}
+
+//--------------------------------------------------------------------------
+void domtree_t::clear()
+{
+  idom.qclear();
+  tin.qclear();
+  tout.qclear();
+}
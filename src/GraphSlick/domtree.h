@@ -0,0 +1,89 @@
+#ifndef __DOMTREE__
+#define __DOMTREE__
+
+/*--------------------------------------------------------------------------
+GraphSlick (c) Elias Bachaalany
+-------------------------------------
+
+Dominator tree module
+
+Computes the dominator tree of a flowchart with the Lengauer-Tarjan
+algorithm and answers dominance queries in constant time
+
+--------------------------------------------------------------------------*/
+
+//--------------------------------------------------------------------------
+#include <pro.h>
+#include "types.hpp"
+#include "bbgraph.h"
+
+//--------------------------------------------------------------------------
+/**
+* @brief Dominator tree of the nodes reachable from a root node
+*/
+class domtree_t
+{
+  /**
+  * @brief Immediate dominator of each node or -1 for the root and
+  *        the unreachable nodes
+  */
+  intvec_t idom;
+
+  /**
+  * @brief Entry and exit times of each node in a walk of the tree.
+  *        -1 for the unreachable nodes
+  */
+  intvec_t tin, tout;
+
+public:
+  /**
+  * @brief Build the tree from the successors and predecessors lists
+  */
+  void build(
+      const adjlist_t &succs,
+      const adjlist_t &preds,
+      int root);
+
+  /**
+  * @brief Clear the tree
+  */
+  void clear();
+
+  /**
+  * @brief Check if a node is reachable from the root
+  */
+  bool is_reachable(int n) const
+  {
+    return tin[n] != -1;
+  }
+
+  /**
+  * @brief Return the immediate dominator of a node or -1
+  */
+  int get_idom(int n) const
+  {
+    return idom[n];
+  }
+
+  /**
+  * @brief Return the count of nodes dominated by a node (itself included)
+  */
+  int get_subtree_size(int n) const
+  {
+    return tin[n] == -1 ? 0 : (tout[n] - tin[n] + 1) / 2;
+  }
+
+  /**
+  * @brief Check if every path from the root to 'b' goes through 'a'.
+  *        A node dominates itself. Always false for unreachable nodes
+  */
+  bool dominates(int a, int b) const
+  {
+    return tin[a] != -1
+        && tin[b] != -1
+        && tin[a] <= tin[b]
+        && tout[b] <= tout[a];
+  }
+};
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef __HASHTAB__
+#define __HASHTAB__
+
+/*--------------------------------------------------------------------------
+GraphSlick (c) Elias Bachaalany
+-------------------------------------
+
+Hash tables module
+
+Flat hash tables keyed by the 64-bit digests computed by the matcher
+
+--------------------------------------------------------------------------*/
+
+//--------------------------------------------------------------------------
+#include <pro.h>
+#include <algorithm>
+#include <utility>
+
+//--------------------------------------------------------------------------
+/**
+* @brief Open addressing table that maps a 64-bit digest to a non negative
+*        integer (usually an index into a vector kept by the caller).
+*        The keys are expected to be well mixed, so the low bits of the key
+*        are used directly as the slot number (linear probing)
+*/
+class digest_index_t
+{
+  struct slot_t
+  {
+    uint64 key;
+    int value;
+  };
+  qvector<slot_t> slots;
+  size_t count;
+
+  size_t mask() const
+  {
+    return slots.size() - 1;
+  }
+
+  /**
+  * @brief Return the slot holding the key or the empty slot where it goes
+  */
+  size_t probe(uint64 key) const
+  {
+    size_t i = size_t(key) & mask();
+    while (slots[i].value != -1 && slots[i].key != key)
+      i = (i + 1) & mask();
+    return i;
+  }
+
+  void rehash(size_t nslots)
+  {
+    qvector<slot_t> old;
+    old.swap(slots);
+
+    slot_t empty;
+    empty.key = 0;
+    empty.value = -1;
+    slots.resize(nslots, empty);
+
+    for (size_t i=0; i < old.size(); i++)
+    {
+      if (old[i].value != -1)
+        slots[probe(old[i].key)] = old[i];
+    }
+  }
+
+public:
+  digest_index_t(size_t expected = 0): count(0)
+  {
+    size_t nslots = 16;
+    while (nslots < expected * 2)
+      nslots <<= 1;
+    rehash(nslots);
+  }
+
+  /**
+  * @brief Return the number of keys
+  */
+  size_t size() const
+  {
+    return count;
+  }
+
+  /**
+  * @brief Return the count of bytes used by the slots
+  */
+  size_t get_memory_size() const
+  {
+    return slots.size() * sizeof(slot_t);
+  }
+
+  /**
+  * @brief Remove all the keys
+  */
+  void clear()
+  {
+    count = 0;
+    slots.qclear();
+    rehash(16);
+  }
+
+  /**
+  * @brief Return the value of a key or -1 if it is not present
+  */
+  int find(uint64 key) const
+  {
+    return slots[probe(key)].value;
+  }
+
+  /**
+  * @brief Insert a key if it is not present.
+  *        Return the value associated with the key
+  */
+  int insert(uint64 key, int value)
+  {
+    size_t i = probe(key);
+    if (slots[i].value != -1)
+      return slots[i].value;
+
+    // Keep the load factor under 1/2
+    if ((count + 1) * 2 > slots.size())
+    {
+      rehash(slots.size() * 2);
+      i = probe(key);
+    }
+
+    slots[i].key = key;
+    slots[i].value = value;
+    ++count;
+    return value;
+  }
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief Flat map from a 64-bit digest to a value. The entries are stored
+*        in insertion order in dense arrays and found with a digest_index_t.
+*        Inserting may move the values: do not keep pointers to them while
+*        the map grows
+*/
+template <class T>
+class digest_map_t
+{
+  digest_index_t index;
+  qvector<uint64> keys;
+  qvector<T> values;
+
+public:
+  /**
+  * @brief Return the number of entries
+  */
+  size_t size() const
+  {
+    return keys.size();
+  }
+
+  bool empty() const
+  {
+    return keys.empty();
+  }
+
+  /**
+  * @brief Remove all the entries
+  */
+  void clear()
+  {
+    index.clear();
+    keys.qclear();
+    values.qclear();
+  }
+
+  /**
+  * @brief Return the value of a key, inserting a default one if needed
+  */
+  T &operator[](uint64 key)
+  {
+    int i = index.insert(key, int(keys.size()));
+    if (i == int(keys.size()))
+    {
+      keys.push_back(key);
+      values.push_back();
+    }
+    return values[i];
+  }
+
+  /**
+  * @brief Return the value of a key or NULL if it is not present
+  */
+  T *find(uint64 key)
+  {
+    int i = index.find(key);
+    return i == -1 ? NULL : &values[i];
+  }
+
+  const T *find(uint64 key) const
+  {
+    int i = index.find(key);
+    return i == -1 ? NULL : &values[i];
+  }
+
+  /**
+  * @brief Access the i-th entry in insertion order
+  */
+  uint64 get_key(size_t i) const
+  {
+    return keys[i];
+  }
+
+  T &get_value(size_t i)
+  {
+    return values[i];
+  }
+
+  const T &get_value(size_t i) const
+  {
+    return values[i];
+  }
+
+  /**
+  * @brief Get the entry indices in ascending key order. Unlike the
+  *        insertion order, it only depends on the set of keys
+  */
+  void get_sorted_order(intvec_t &order) const
+  {
+    qvector< std::pair<uint64, int> > sorted;
+    sorted.resize(keys.size());
+    for (size_t i=0; i < keys.size(); i++)
+      sorted[i] = std::make_pair(keys[i], int(i));
+    std::sort(sorted.begin(), sorted.end());
+
+    order.resize(sorted.size());
+    for (size_t i=0; i < sorted.size(); i++)
+      order[i] = sorted[i].second;
+  }
+};
+
+#endif
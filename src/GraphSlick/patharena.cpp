@@ -0,0 +1,264 @@
+#include "patharena.h"
+#include "bbfeatures.h"
+
+//--------------------------------------------------------------------------
+// The per path offsets, sizes and index cannot be spilled. Past the budget
+// the packed bytes are spilled by chunks of at least this size (or of the
+// budget if it is smaller) so each new path is not written on its own
+#define ARENA_MIN_SPILL 65536
+
+//--------------------------------------------------------------------------
+static void put_varint(bytevec_t &out, uint32 v)
+{
+  while (v >= 0x80)
+  {
+    out.push_back(uchar(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(uchar(v));
+}
+
+//--------------------------------------------------------------------------
+static const uchar *get_varint(const uchar *ptr, uint32 *v)
+{
+  uint32 r = 0;
+  for (int shift=0; ; shift += 7)
+  {
+    uchar b = *ptr++;
+    r |= uint32(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      break;
+  }
+  *v = r;
+  return ptr;
+}
+
+//--------------------------------------------------------------------------
+void pack_path(bytevec_t &out, const intvec_t &path)
+{
+  put_varint(out, uint32(path.size()));
+
+  // Consecutive nodes of a path are usually close: zigzag encode the
+  // differences so small negative steps stay short too
+  int prev = 0;
+  for (size_t i=0; i < path.size(); i++)
+  {
+    int d = path[i] - prev;
+    put_varint(out, (uint32(d) << 1) ^ uint32(d >> 31));
+    prev = path[i];
+  }
+}
+
+//--------------------------------------------------------------------------
+const uchar *unpack_path(const uchar *ptr, intvec_t &path)
+{
+  uint32 count;
+  ptr = get_varint(ptr, &count);
+
+  path.resize(count);
+  int prev = 0;
+  for (uint32 i=0; i < count; i++)
+  {
+    uint32 z;
+    ptr = get_varint(ptr, &z);
+    prev += int(z >> 1) ^ -int(z & 1);
+    path[i] = prev;
+  }
+  return ptr;
+}
+
+//--------------------------------------------------------------------------
+uint64 hash_path(const intvec_t &path)
+{
+  hash64_t h;
+  if (!path.empty())
+    h.update(&path[0], path.size() * sizeof(int));
+  return h.digest();
+}
+
+//--------------------------------------------------------------------------
+void path_arena_t::clear()
+{
+  bytes.qclear();
+  offsets.qclear();
+  sizes.qclear();
+  index.clear();
+  next.qclear();
+  buf.qclear();
+  spilled = 0;
+  spill_failed = false;
+  if (fp != NULL)
+  {
+    qfclose(fp);
+    fp = NULL;
+    qunlink(fname);
+    fname[0] = '\0';
+  }
+}
+
+//--------------------------------------------------------------------------
+void path_arena_t::spill()
+{
+  if (spill_failed)
+    return;
+
+  if (fp == NULL)
+  {
+    if (qtmpnam(fname, sizeof(fname)) != NULL)
+      fp = qfopen(fname, "w+b");
+    if (fp == NULL)
+    {
+      // Keep everything in memory
+      fname[0] = '\0';
+      spill_failed = true;
+      return;
+    }
+  }
+
+  // Write at the end of the last complete spill. A partial write is never
+  // read back: the bytes stay in memory and no more spills are attempted
+  if (   qfseek64(fp, int64(spilled), SEEK_SET) != 0
+      || qfwrite(fp, &bytes[0], bytes.size()) != ssize_t(bytes.size()))
+  {
+    spill_failed = true;
+    return;
+  }
+
+  spilled += bytes.size();
+  bytes.qclear();
+}
+
+//--------------------------------------------------------------------------
+int path_arena_t::find(int first, const intvec_t &path) const
+{
+  intvec_t other;
+  for (int i=first; i != -1; i=next[i])
+  {
+    if (sizes[i] != int(path.size()))
+      continue;
+    get(i, other);
+    if (other == path)
+      return i;
+  }
+  return -1;
+}
+
+//--------------------------------------------------------------------------
+int path_arena_t::add(const intvec_t &path, uint64 hash)
+{
+  qmutex_lock(lock);
+  int id = size();
+  int first = index.insert(hash, id);
+  if (first != id)
+  {
+    // Same hash: return the stored copy or link the new path after the
+    // first one
+    int found = find(first, path);
+    if (found != -1)
+    {
+      qmutex_unlock(lock);
+      return found;
+    }
+    next.push_back(next[first]);
+    next[first] = id;
+  }
+  else
+  {
+    next.push_back(-1);
+  }
+
+  offsets.push_back(spilled + bytes.size());
+  sizes.push_back(int(path.size()));
+  pack_path(bytes, path);
+
+  // The spilled paths are whole so a path is either in memory or in the file
+  if (   budget != 0
+      && get_memory_size() > budget
+      && bytes.size() >= qmin(budget, size_t(ARENA_MIN_SPILL)))
+  {
+    spill();
+  }
+
+  qmutex_unlock(lock);
+  return id;
+}
+
+//--------------------------------------------------------------------------
+void path_arena_t::get(int id, intvec_t &path) const
+{
+  uint64 off = offsets[id];
+  if (off >= spilled)
+  {
+    unpack_path(&bytes[size_t(off - spilled)], path);
+    return;
+  }
+
+  uint64 end = id + 1 < size() ? offsets[id + 1] : spilled;
+  buf.resize(size_t(end - off));
+  if (   qfseek64(fp, int64(off), SEEK_SET) != 0
+      || qfread(fp, &buf[0], buf.size()) != ssize_t(buf.size()))
+  {
+    path.qclear();
+    return;
+  }
+  unpack_path(&buf[0], path);
+}
+
+//--------------------------------------------------------------------------
+size_t path_arena_t::get_memory_size() const
+{
+  return bytes.size()
+       + offsets.size() * sizeof(uint64)
+       + sizes.size() * sizeof(int)
+       + next.size() * sizeof(int)
+       + index.get_memory_size();
+}
+
+//--------------------------------------------------------------------------
+int arena_pathlist_t::find_id(int first, int id) const
+{
+  for (int i=first; i != -1; i=next[i])
+  {
+    if (ids[i] == id)
+      return i;
+  }
+  return -1;
+}
+
+//--------------------------------------------------------------------------
+void arena_pathlist_t::link(int first, int id)
+{
+  // Link the new path after the first one with the same hash
+  int idx = int(ids.size());
+  if (first != idx)
+  {
+    next.push_back(next[first]);
+    next[first] = idx;
+  }
+  else
+  {
+    next.push_back(-1);
+  }
+  ids.push_back(id);
+}
+
+//--------------------------------------------------------------------------
+bool arena_pathlist_t::add_path(path_arena_t &arena, const intvec_t &path)
+{
+  uint64 hash = hash_path(path);
+  return add_id(arena.add(path, hash), hash);
+}
+
+//--------------------------------------------------------------------------
+bool arena_pathlist_t::add_id(int id, uint64 hash)
+{
+  int idx = int(ids.size());
+  int first = index.insert(hash, idx);
+
+  // Same hash: look for the same arena index in the chain
+  if (first != idx && find_id(first, id) != -1)
+    return false;
+
+  link(first, id);
+  return true;
+}
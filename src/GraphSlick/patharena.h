@@ -0,0 +1,221 @@
+#ifndef __PATHARENA__
+#define __PATHARENA__
+
+/*--------------------------------------------------------------------------
+GraphSlick (c) Elias Bachaalany
+-------------------------------------
+
+Path arena module
+
+Compact storage for the node paths kept by the matcher. Each path is stored
+once, its node ids delta encoded as variable length integers, and the oldest
+paths can be spilled to a temporary file to bound the memory use
+
+--------------------------------------------------------------------------*/
+
+//--------------------------------------------------------------------------
+#include <pro.h>
+#include "types.hpp"
+#include "hashtab.h"
+
+//--------------------------------------------------------------------------
+/**
+* @brief Append a path to a byte buffer: the node count followed by the
+*        zigzag encoded differences between consecutive node ids
+*/
+void pack_path(bytevec_t &out, const intvec_t &path);
+
+/**
+* @brief Decode a path written by pack_path().
+*        Return a pointer past the decoded bytes
+*/
+const uchar *unpack_path(const uchar *ptr, intvec_t &path);
+
+/**
+* @brief Hash of the node sequence of a path, as used by arena_pathlist_t
+*/
+uint64 hash_path(const intvec_t &path);
+
+//--------------------------------------------------------------------------
+/**
+* @brief Append only store of unique packed paths. The paths are identified
+*        by their insertion index. Adding is thread safe, reading is not
+*/
+class path_arena_t
+{
+  /**
+  * @brief Packed paths that were not spilled yet
+  */
+  bytevec_t bytes;
+
+  /**
+  * @brief Offset of each path in the whole packed stream
+  */
+  qvector<uint64> offsets;
+
+  /**
+  * @brief Node count of each path
+  */
+  intvec_t sizes;
+
+  /**
+  * @brief Node sequence hash -> first path with that hash
+  */
+  digest_index_t index;
+
+  /**
+  * @brief Next path with the same hash or -1
+  */
+  intvec_t next;
+
+  /**
+  * @brief Maximum count of bytes kept in memory, the per path offsets,
+  *        sizes and index included (0 = no limit)
+  */
+  size_t budget;
+
+  /**
+  * @brief Count of bytes moved to the spill file
+  */
+  uint64 spilled;
+
+  /**
+  * @brief Set when the spill file cannot be created or written: the
+  *        paths are kept in memory from then on
+  */
+  bool spill_failed;
+
+  FILE *fp;
+  char fname[QMAXPATH];
+  mutable bytevec_t buf;
+  qmutex_t lock;
+
+  void spill();
+
+  int find(int first, const intvec_t &path) const;
+
+  // Not copyable
+  path_arena_t(const path_arena_t &);
+  path_arena_t &operator=(const path_arena_t &);
+
+public:
+  path_arena_t(): budget(0), spilled(0), spill_failed(false), fp(NULL)
+  {
+    fname[0] = '\0';
+    lock = qmutex_create();
+  }
+
+  ~path_arena_t()
+  {
+    clear();
+    qmutex_free(lock);
+  }
+
+  /**
+  * @brief Set the count of bytes kept in memory (0 = no limit)
+  */
+  void set_budget(size_t bytes_count)
+  {
+    budget = bytes_count;
+  }
+
+  /**
+  * @brief Remove all the paths and delete the spill file
+  */
+  void clear();
+
+  /**
+  * @brief Add a path if it is not stored yet and return its index.
+  *        'hash' is the hash_path() of the path. Past the budget the
+  *        packed paths are spilled right away
+  */
+  int add(const intvec_t &path, uint64 hash);
+
+  int add(const intvec_t &path)
+  {
+    return add(path, hash_path(path));
+  }
+
+  /**
+  * @brief Return the count of paths
+  */
+  int size() const
+  {
+    return int(sizes.size());
+  }
+
+  /**
+  * @brief Return the node count of a path without decoding it
+  */
+  int get_path_size(int id) const
+  {
+    return sizes[id];
+  }
+
+  /**
+  * @brief Decode a path
+  */
+  void get(int id, intvec_t &path) const;
+
+  /**
+  * @brief Return the count of bytes used in memory
+  */
+  size_t get_memory_size() const;
+};
+
+//--------------------------------------------------------------------------
+/**
+* @brief List of unique paths stored in an arena. This is the packed
+*        counterpart of pathlist_t. The arena stores each path once, so
+*        the paths with the same hash are told apart by their arena index
+*/
+class arena_pathlist_t
+{
+  /**
+  * @brief Arena indices of the paths
+  */
+  intvec_t ids;
+
+  /**
+  * @brief Node sequence hash -> first path with that hash
+  */
+  digest_index_t index;
+
+  /**
+  * @brief Next path with the same hash or -1
+  */
+  intvec_t next;
+
+  int find_id(int first, int id) const;
+
+  void link(int first, int id);
+
+public:
+  /**
+  * @brief Append a path if it is not in the list yet.
+  *        Return true if the path was added
+  */
+  bool add_path(path_arena_t &arena, const intvec_t &path);
+
+  /**
+  * @brief Append a path already stored in the arena if it is not in the
+  *        list yet. 'hash' is the hash_path() of the path.
+  *        Return true if the path was added
+  */
+  bool add_id(int id, uint64 hash);
+
+  size_t size() const
+  {
+    return ids.size();
+  }
+
+  /**
+  * @brief Return the arena index of the i-th path
+  */
+  int get_id(size_t i) const
+  {
+    return ids[i];
+  }
+};
+
+#endif
@@ -107,6 +107,7 @@ TODO
 #include "algo.hpp"
 #include "colorgen.h"
 #include "pybbmatcher.h"
+#include "bbmatcher.h"
 
 //--------------------------------------------------------------------------
 // Some defines
@@ -144,6 +145,20 @@ enum gvrefresh_modes_e
   gvrfm_combined_mode,
 };
 
+//--------------------------------------------------------------------------
+enum matcher_engine_e
+{
+  mte_python,
+  mte_native,
+};
+
+//--------------------------------------------------------------------------
+// Interval at which the streamed analysis results are applied
+#define ANALYZE_POLL_MS 200
+
+// Count of polls between two progress reports
+#define ANALYZE_PROGRESS_POLLS 5
+
 //--------------------------------------------------------------------------
 #define DECL_CG \
   colorgen_t cg; \
@@ -202,6 +217,51 @@ struct gsoptions_t
   */
   gvrefresh_modes_e start_view_mode;
 
+  /**
+  * @brief The matcher used by Analyze() and FindSimilar()
+  */
+  matcher_engine_e matcher_engine;
+
+  /**
+  * @brief Run the Python matcher after the native one and report differences
+  */
+  bool verify_native_matcher;
+
+  /**
+  * @brief Number of threads used by the native matcher (0 = one per CPU)
+  */
+  int matcher_threads;
+
+  /**
+  * @brief How the native matcher discovers the repeated regions
+  */
+  bbdiscovery_t matcher_discovery;
+
+  /**
+  * @brief Also match the blocks whose itype sequences are within a small
+  *        edit distance before falling back to the frequency match
+  */
+  bool match_edit_distance;
+
+  /**
+  * @brief Only find the largest wellformed function groups (0 = all).
+  *        The analysis only ends early if the entry block of the function
+  *        has no predecessor
+  */
+  int max_groups;
+
+  /**
+  * @brief Memory kept by the native matcher for its paths, in MB (0 = no
+  *        limit). The rest goes to a temporary file
+  */
+  int memory_budget_mb;
+
+  /**
+  * @brief With a memory budget: keep the paths FindSimilar() needs to
+  *        highlight similar subgraphs. Otherwise it only finds single nodes
+  */
+  bool keep_similar_paths;
+
   /**
   * @brief Constructor
   */
@@ -215,6 +275,14 @@ struct gsoptions_t
     start_view_mode = gvrfm_combined_mode; // gvrfm_single_mode;
     debug = true;
     graph_layout = layout_digraph;
+    matcher_engine = mte_native;
+    verify_native_matcher = false;
+    matcher_threads = 0;
+    matcher_discovery = BBD_SEED_PAIRS;
+    match_edit_distance = false;
+    max_groups = 0;
+    memory_budget_mb = 0;
+    keep_similar_paths = true;
     //;!
     no_initial_path_info = false;
   }
@@ -1902,6 +1970,61 @@ enum gsch_line_type_t
   chlt_ng  = 3,
 };
 
+//--------------------------------------------------------------------------
+/**
+* @brief Groups published by the matcher thread and collected by the UI
+*        thread
+*/
+class group_queue_t: public bbgroup_sink_t
+{
+  int_3dvec_t pending;
+  bool done;
+  qmutex_t lock;
+
+public:
+  group_queue_t(): done(false)
+  {
+    lock = qmutex_create();
+  }
+
+  ~group_queue_t()
+  {
+    qmutex_free(lock);
+  }
+
+  virtual void add_group(const int_2dvec_t &group)
+  {
+    qmutex_lock(lock);
+    pending.push_back(group);
+    qmutex_unlock(lock);
+  }
+
+  /**
+  * @brief Mark the end of the analysis
+  */
+  void set_done()
+  {
+    qmutex_lock(lock);
+    done = true;
+    qmutex_unlock(lock);
+  }
+
+  /**
+  * @brief Append the pending groups to 'groups'.
+  *        Return true once all the groups were collected
+  */
+  bool drain(int_3dvec_t &groups)
+  {
+    qmutex_lock(lock);
+    for (int_3dvec_t::iterator it=pending.begin(); it != pending.end(); ++it)
+      groups.push_back(*it);
+    pending.qclear();
+    bool ok = done;
+    qmutex_unlock(lock);
+    return ok;
+  }
+};
+
 //--------------------------------------------------------------------------
 /**
 * @brief Chooser line structure
@@ -1947,6 +2070,19 @@ private:
   gsoptions_t options;
 
   PyBBMatcher *py_matcher;
+  BBMatcher *bb_matcher;
+
+  /**
+  * @brief State of the native analysis running in the background
+  */
+  qthread_t analyze_thread;
+  qtimer_t analyze_timer;
+  group_queue_t *analyze_queue;
+  int_3dvec_t analyze_result;
+  ea_t analyze_ea;
+  qstring analyze_filename;
+  int analyze_polls;
+  size_t analyze_reported;
 
   static uint32 idaapi s_sizer(void *obj)
   {
@@ -1998,6 +2134,20 @@ private:
     ((gschooser_t *)obj)->on_select(sel);
   }
 
+  static int idaapi s_analyze_thread(void *obj)
+  {
+    gschooser_t *self = (gschooser_t *)obj;
+    int_3dvec_t result;
+    self->bb_matcher->Run(result);
+    self->analyze_queue->set_done();
+    return 0;
+  }
+
+  static int idaapi s_analyze_timer(void *obj)
+  {
+    return ((gschooser_t *)obj)->on_analyze_timer();
+  }
+
   static uint32 idaapi s_onmenu_save_bbfile(void *obj, uint32 n)
   {
     ((gschooser_t *)obj)->onmenu_save_bbfile();
@@ -2016,12 +2166,401 @@ private:
     return n;
   }
 
+  static uint32 idaapi s_onmenu_cancel_analysis(void *obj, uint32 n)
+  {
+    ((gschooser_t *)obj)->onmenu_cancel_analysis();
+    return n;
+  }
+
   static uint32 idaapi s_onmenu_auto_find_path(void *obj, uint32 n)
   {
     ((gschooser_t *)obj)->onmenu_analyze();
     return n;
   }
 
+  static uint32 idaapi s_onmenu_switch_matcher(void *obj, uint32 n)
+  {
+    ((gschooser_t *)obj)->onmenu_switch_matcher();
+    return n;
+  }
+
+  static uint32 idaapi s_onmenu_switch_discovery(void *obj, uint32 n)
+  {
+    ((gschooser_t *)obj)->onmenu_switch_discovery();
+    return n;
+  }
+
+  static uint32 idaapi s_onmenu_toggle_edit_distance(void *obj, uint32 n)
+  {
+    ((gschooser_t *)obj)->onmenu_toggle_edit_distance();
+    return n;
+  }
+
+  static uint32 idaapi s_onmenu_set_max_groups(void *obj, uint32 n)
+  {
+    ((gschooser_t *)obj)->onmenu_set_max_groups();
+    return n;
+  }
+
+  static uint32 idaapi s_onmenu_set_memory_budget(void *obj, uint32 n)
+  {
+    ((gschooser_t *)obj)->onmenu_set_memory_budget();
+    return n;
+  }
+
+  static uint32 idaapi s_onmenu_check_hash_compat(void *obj, uint32 n)
+  {
+    ((gschooser_t *)obj)->onmenu_check_hash_compat();
+    return n;
+  }
+
+  /**
+  * @brief Check on all the functions of the database that the order
+  *        insensitive block hash groups the blocks like the reference hash
+  */
+  void onmenu_check_hash_compat()
+  {
+    hash_compat_t compat;
+    size_t nfuncs = get_func_qty();
+
+    show_wait_box("Checking block hashes...");
+    for (size_t i=0; i < nfuncs; i++)
+    {
+      if (wasBreak())
+        break;
+
+      func_t *f = getn_func(i);
+      qflow_chart_t fc;
+      if (f == NULL || !get_func_flowchart(f->startEA, fc))
+        continue;
+
+      check_hash_itype2_compat(fc, compat);
+    }
+    hide_wait_box();
+
+    msg(STR_GS_MSG "Checked %d block(s): %d hash conflict(s)\n",
+      compat.blocks,
+      compat.conflicts);
+  }
+
+  /**
+  * @brief Switch between the seed pairs and the WL signatures discovery
+  */
+  void onmenu_switch_discovery()
+  {
+    if (options.matcher_discovery == BBD_SEED_PAIRS)
+      options.matcher_discovery = BBD_WL_SIGNATURES;
+    else
+      options.matcher_discovery = BBD_SEED_PAIRS;
+
+    msg(STR_GS_MSG "Using the %s discovery\n",
+      options.matcher_discovery == BBD_SEED_PAIRS ? "seed pairs" : "WL signatures");
+  }
+
+  /**
+  * @brief Toggle the edit distance stage of the native matcher
+  */
+  void onmenu_toggle_edit_distance()
+  {
+    options.match_edit_distance = !options.match_edit_distance;
+    msg(STR_GS_MSG "Edit distance match is %s\n",
+      options.match_edit_distance ? "on" : "off");
+  }
+
+  /**
+  * @brief Cancel the running analysis. The groups found so far are kept
+  */
+  void onmenu_cancel_analysis()
+  {
+    if (analyze_queue == NULL)
+    {
+      msg(STR_GS_MSG "No analysis is running\n");
+      return;
+    }
+    bb_matcher->get_progress().cancel();
+  }
+
+  /**
+  * @brief Ask for the maximum count of groups the native matcher finds
+  */
+  void onmenu_set_max_groups()
+  {
+    sval_t count = options.max_groups;
+    if (!asklong(&count, "Maximum count of groups (0 for all)") || count < 0)
+      return;
+
+    options.max_groups = int(count);
+    if (count > 0)
+    {
+      msg(STR_GS_MSG "Looking for the %d largest groups. All the seeds are still explored when the function entry block has predecessors\n",
+        options.max_groups);
+    }
+  }
+
+  /**
+  * @brief Ask for the memory budget of the native matcher
+  */
+  void onmenu_set_memory_budget()
+  {
+    sval_t mb = options.memory_budget_mb;
+    if (!asklong(&mb, "Memory budget of the matcher paths in MB (0 for no limit)") || mb < 0)
+      return;
+
+    options.memory_budget_mb = int(mb);
+    if (mb == 0)
+      return;
+
+    int code = askyn_c(
+      options.keep_similar_paths ? ASKBTN_YES : ASKBTN_NO,
+      "Keep the paths needed to highlight similar subgraphs?\n"
+      "Otherwise only single similar nodes are found");
+    if (code != ASKBTN_CANCEL)
+      options.keep_similar_paths = code == ASKBTN_YES;
+  }
+
+  /**
+  * @brief Switch between the native and the Python matcher
+  */
+  void onmenu_switch_matcher()
+  {
+    if (options.matcher_engine == mte_native)
+    {
+      if (py_matcher == NULL)
+      {
+        msg(STR_GS_MSG "The Python matcher is not available\n");
+        return;
+      }
+      options.matcher_engine = mte_python;
+    }
+    else
+    {
+      options.matcher_engine = mte_native;
+    }
+    msg(STR_GS_MSG "Using the %s matcher\n",
+      options.matcher_engine == mte_native ? "native" : "Python");
+  }
+
+  /**
+  * @brief Apply the options to the native matcher
+  */
+  void configure_matcher()
+  {
+    bb_matcher->set_threads(options.matcher_threads);
+    bb_matcher->set_discovery(options.matcher_discovery);
+    bb_matcher->set_max_groups(options.max_groups);
+
+    bb_matcher->set_memory_budget(
+      size_t(options.memory_budget_mb) << 20,
+      options.keep_similar_paths);
+
+    static const bbhash_type_t edit_chain[] = { BBH_ITYPE1, BBH_ITYPE2, BBH_EDIT, BBH_FREQ };
+    if (options.match_edit_distance)
+      bb_matcher->set_match_chain(edit_chain, qnumber(edit_chain));
+    else
+      bb_matcher->set_match_chain(NULL, 0);
+  }
+
+  /**
+  * @brief Analyze a function with the selected matcher
+  */
+  void analyze_function(ea_t func_ea, int_3dvec_t &result)
+  {
+    if (options.matcher_engine == mte_python)
+    {
+#ifndef NO_PYTHON
+      if (py_matcher != NULL)
+        py_matcher->Analyze(func_ea, result);
+#endif
+      return;
+    }
+
+    configure_matcher();
+    bb_matcher->Analyze(func_fc, result);
+
+#ifndef NO_PYTHON
+    if (options.verify_native_matcher && py_matcher != NULL)
+      verify_native_result(func_ea, result);
+#endif
+  }
+
+  /**
+  * @brief Compare the native matcher result against the Python reference
+  */
+  void verify_native_result(ea_t func_ea, const int_3dvec_t &result)
+  {
+    int_3dvec_t py_result;
+    py_matcher->Analyze(func_ea, py_result);
+
+    int_3dvec_t native_result = result;
+    BBMatcher::Canonicalize(native_result);
+    BBMatcher::Canonicalize(py_result);
+
+    if (native_result == py_result)
+    {
+      msg(STR_GS_MSG "Matchers agree on %a: %d group(s)\n",
+        func_ea,
+        int(native_result.size()));
+    }
+    else
+    {
+      msg(STR_GS_MSG "Matchers disagree on %a: native=%d Python=%d group(s)\n",
+        func_ea,
+        int(native_result.size()),
+        int(py_result.size()));
+    }
+  }
+
+  /**
+  * @brief Start the native analysis of the current flowchart on a separate
+  *        thread. The groups are shown as they are found, largest first
+  */
+  void start_analysis(ea_t func_ea, const char *def_filename)
+  {
+    configure_matcher();
+
+    // Decoding the blocks calls the database: do it on this thread
+    bb_matcher->Prepare(func_fc);
+
+    analyze_ea = func_ea;
+    analyze_filename = def_filename == NULL ? "" : def_filename;
+    analyze_result.qclear();
+    analyze_polls = 0;
+    analyze_reported = 0;
+
+    // Show the ungrouped function until the first groups arrive
+    build_groupman_from_fc(&func_fc, gm, true);
+    show_analysis_result();
+
+    analyze_queue = new group_queue_t();
+    bb_matcher->set_sink(analyze_queue);
+
+    analyze_thread = qthread_create(s_analyze_thread, this);
+    if (analyze_thread == NULL)
+    {
+      // No thread: analyze synchronously
+      s_analyze_thread(this);
+      on_analyze_timer();
+      return;
+    }
+    analyze_timer = register_timer(ANALYZE_POLL_MS, s_analyze_timer, this);
+  }
+
+  /**
+  * @brief Collect the groups found since the last call and rebuild the
+  *        grouping with them. Return the delay until the next call or -1
+  *        once the analysis is over
+  */
+  int on_analyze_timer()
+  {
+    size_t old_count = analyze_result.size();
+    bool done = analyze_queue->drain(analyze_result);
+
+    if (analyze_result.size() != old_count)
+    {
+      build_groupman_from_3dvec(&func_fc, analyze_result, gm, true);
+      show_analysis_result();
+    }
+
+    if (!done)
+    {
+      if (++analyze_polls % ANALYZE_PROGRESS_POLLS == 0)
+        report_analysis_progress();
+      return ANALYZE_POLL_MS;
+    }
+
+    // Returning -1 unregisters the timer
+    analyze_timer = NULL;
+    release_analysis();
+
+    if (bb_matcher->get_progress().is_cancelled())
+    {
+      msg(STR_GS_MSG "Analysis of %a cancelled, %d group(s) kept. Similar nodes are only searched in the explored seeds\n",
+        analyze_ea,
+        int(analyze_result.size()));
+      return -1;
+    }
+
+    msg(STR_GS_MSG "Found %d group(s) in %a\n",
+      int(analyze_result.size()),
+      analyze_ea);
+
+#ifndef NO_PYTHON
+    if (options.verify_native_matcher && py_matcher != NULL)
+      verify_native_result(analyze_ea, analyze_result);
+#endif
+    return -1;
+  }
+
+  /**
+  * @brief Show the progress counters of the running analysis if they
+  *        changed since the last report
+  */
+  void report_analysis_progress()
+  {
+    size_t total, done, paths;
+    bb_matcher->get_progress().get(&total, &done, &paths);
+    if (done == analyze_reported)
+      return;
+
+    analyze_reported = done;
+    msg(STR_GS_MSG "Analyzing %a: %d/%d seed pair(s), %d path(s)\n",
+      analyze_ea,
+      int(done),
+      int(total),
+      int(paths));
+  }
+
+  /**
+  * @brief Wait for the analysis thread and free the streaming state
+  */
+  void release_analysis()
+  {
+    if (analyze_thread != NULL)
+    {
+      qthread_join(analyze_thread);
+      qthread_free(analyze_thread);
+      analyze_thread = NULL;
+    }
+
+    bb_matcher->set_sink(NULL);
+    delete analyze_queue;
+    analyze_queue = NULL;
+  }
+
+  /**
+  * @brief Cancel a running analysis and stop collecting its results
+  */
+  void stop_analysis()
+  {
+    if (analyze_queue == NULL)
+      return;
+
+    bb_matcher->get_progress().cancel();
+
+    if (analyze_timer != NULL)
+    {
+      unregister_timer(analyze_timer);
+      analyze_timer = NULL;
+    }
+    release_analysis();
+  }
+
+  /**
+  * @brief Refresh the chooser and the graph after the grouping changed
+  */
+  void show_analysis_result()
+  {
+    if (!analyze_filename.empty())
+      gm->src_filename = analyze_filename;
+
+    refresh(true);
+
+    if (gsgv == NULL)
+      show_graph();
+    else
+      gsgv->redo_current_layout();
+  }
+
   /**
   * @brief Handle the save bbgroup menu command
   */
@@ -2043,6 +2582,12 @@ private:
   */
   void onmenu_analyze(const char *def_filename = NULL)
   {
+      if (analyze_queue != NULL)
+      {
+          msg(STR_GS_MSG "An analysis is already running\n");
+          return;
+      }
+
       func_t *f = get_func(get_screen_ea());
       if (f == NULL)
       {
@@ -2050,14 +2595,20 @@ private:
           return;
       }
 
-      // Call Analyzer
-      int_3dvec_t result;
-#ifndef NO_PYTHON
-      py_matcher->Analyze(f->startEA, result);
-#endif
       if (!get_flowchart(f->startEA))
           return;
 
+      // The native matcher runs in the background
+      if (options.matcher_engine == mte_native && !options.no_initial_path_info)
+      {
+          start_analysis(f->startEA, def_filename);
+          return;
+      }
+
+      // Call Analyzer
+      int_3dvec_t result;
+      analyze_function(f->startEA, result);
+
       // reset groupping
       if (result.empty() || options.no_initial_path_info)
       {
@@ -2391,6 +2942,9 @@ private:
     if (chi.popup_names != NULL)
       qfree((void *)chi.popup_names);
 
+    // Cancel the background analysis
+    stop_analysis();
+
     // Close the associated graph
     close_graph();
 
@@ -2486,10 +3040,22 @@ private:
   */
   pnodegroup_list_t find_similar(intvec_t &sel_nodes)
   {
-#ifndef NO_PYTHON
-    //TODO:
     int_2dvec_t ng_vec;
-    if (!py_matcher->FindSimilar(sel_nodes, ng_vec) || ng_vec.empty())
+    bool ok;
+    if (options.matcher_engine == mte_native)
+    {
+      // The matcher state is incomplete until the analysis is over
+      ok = analyze_queue == NULL && bb_matcher->FindSimilar(sel_nodes, ng_vec);
+    }
+    else
+    {
+#ifndef NO_PYTHON
+      ok = py_matcher != NULL && py_matcher->FindSimilar(sel_nodes, ng_vec);
+#else
+      ok = false;
+#endif
+    }
+    if (!ok || ng_vec.empty())
       return NULL;
 
     // Build NG
@@ -2517,9 +3083,6 @@ private:
       }
     }
     return ngl;
-#else
-      return NULL;
-#endif
   }
 
   /**
@@ -2625,7 +3188,14 @@ private:
     add_menu("Save bbgroup file", s_onmenu_save_bbfile, "Ctrl-S");
     add_menu("Show graph", s_onmenu_show_graph);
     add_menu("Analyze", s_onmenu_analyze);
+    add_menu("Cancel analysis", s_onmenu_cancel_analysis);
     add_menu("Automatically find path", s_onmenu_auto_find_path);
+    add_menu("Switch matcher engine", s_onmenu_switch_matcher);
+    add_menu("Switch discovery engine", s_onmenu_switch_discovery);
+    add_menu("Toggle edit distance match", s_onmenu_toggle_edit_distance);
+    add_menu("Set maximum group count", s_onmenu_set_max_groups);
+    add_menu("Set memory budget", s_onmenu_set_memory_budget);
+    add_menu("Check hash compatibility", s_onmenu_check_hash_compat);
   }
 
   /**
@@ -2682,6 +3252,13 @@ public:
     gsgv = NULL;
     gm = NULL;
     py_matcher = NULL;
+    bb_matcher = new BBMatcher();
+    analyze_thread = NULL;
+    analyze_timer = NULL;
+    analyze_queue = NULL;
+    analyze_ea = BADADDR;
+    analyze_polls = 0;
+    analyze_reported = 0;
     gm = new groupman_t();
   }
 
@@ -2692,6 +3269,7 @@ public:
   {
     //NOTE: IDA will close the chooser for us and thus the destroy callback will be called
     delete py_matcher;
+    delete bb_matcher;
   }
 
   /**
@@ -2807,7 +3385,10 @@ public:
       msg(STR_GS_MSG "Error: %s\n", err);
       delete py_matcher;
       py_matcher = NULL;
-      return false;
+
+      // The native matcher does not need Python
+      if (options.matcher_engine == mte_python)
+        return false;
     }
 #endif
     return true;
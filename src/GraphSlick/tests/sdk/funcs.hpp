@@ -0,0 +1,14 @@
+#ifndef _FUNCS_HPP
+#define _FUNCS_HPP
+#include "pro.h"
+
+struct area_t
+{
+  ea_t startEA, endEA;
+};
+
+struct func_t: public area_t
+{
+};
+
+#endif
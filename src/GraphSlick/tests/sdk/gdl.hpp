@@ -0,0 +1,25 @@
+#ifndef _GDL_HPP
+#define _GDL_HPP
+#include "funcs.hpp"
+
+struct qbasic_block_t: public area_t
+{
+  intvec_t succ;
+  intvec_t pred;
+};
+
+#define FC_PREDS 0x0002
+
+class qflow_chart_t
+{
+public:
+  qvector<qbasic_block_t> blocks;
+
+  int size() const { return int(blocks.size()); }
+  int nsucc(int n) const { return int(blocks[n].succ.size()); }
+  int npred(int n) const { return int(blocks[n].pred.size()); }
+  int succ(int n, int i) const { return blocks[n].succ[i]; }
+  int pred(int n, int i) const { return blocks[n].pred[i]; }
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include <pro.h>
+#include <ua.hpp>
+#include <pthread.h>
+#include <unistd.h>
+
+//--------------------------------------------------------------------------
+int msg(const char *format, ...)
+{
+  va_list va;
+  va_start(va, format);
+  int r = vprintf(format, va);
+  va_end(va);
+  return r;
+}
+
+//--------------------------------------------------------------------------
+int qsnprintf(char *buf, size_t size, const char *format, ...)
+{
+  va_list va;
+  va_start(va, format);
+  int r = vsnprintf(buf, size, format, va);
+  va_end(va);
+  return r;
+}
+
+//--------------------------------------------------------------------------
+qmutex_t qmutex_create()
+{
+  pthread_mutex_t *m = new pthread_mutex_t;
+  pthread_mutex_init(m, NULL);
+  return (qmutex_t)m;
+}
+
+bool qmutex_free(qmutex_t m)
+{
+  pthread_mutex_destroy((pthread_mutex_t *)m);
+  delete (pthread_mutex_t *)m;
+  return true;
+}
+
+bool qmutex_lock(qmutex_t m)
+{
+  return pthread_mutex_lock((pthread_mutex_t *)m) == 0;
+}
+
+bool qmutex_unlock(qmutex_t m)
+{
+  return pthread_mutex_unlock((pthread_mutex_t *)m) == 0;
+}
+
+//--------------------------------------------------------------------------
+FILE *qfopen(const char *file, const char *mode)
+{
+  return fopen(file, mode);
+}
+
+int qfclose(FILE *fp)
+{
+  return fclose(fp);
+}
+
+ssize_t qfread(FILE *fp, void *buf, size_t n)
+{
+  return ssize_t(fread(buf, 1, n, fp));
+}
+
+ssize_t qfwrite(FILE *fp, const void *buf, size_t n)
+{
+  return ssize_t(fwrite(buf, 1, n, fp));
+}
+
+int qfseek64(FILE *fp, int64 offset, int whence)
+{
+  return fseeko(fp, off_t(offset), whence);
+}
+
+char *qtmpnam(char *buf, size_t bufsize)
+{
+  char name[] = "/tmp/gstestXXXXXX";
+  int fd = mkstemp(name);
+  if (fd == -1 || strlen(name) >= bufsize)
+    return NULL;
+  close(fd);
+  strcpy(buf, name);
+  return buf;
+}
+
+int qunlink(const char *file)
+{
+  return unlink(file);
+}
+
+//--------------------------------------------------------------------------
+insn_t cmd;
+
+int idaapi decode_insn(ea_t)
+{
+  return 0;
+}
@@ -0,0 +1,103 @@
+#ifndef _PRO_H
+#define _PRO_H
+
+/*--------------------------------------------------------------------------
+Minimal stand-in for the IDA SDK pro.h so the analysis modules can be built
+and tested outside of IDA. Only what the tested modules use is declared
+--------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#define idaapi
+
+typedef unsigned long long uint64;
+typedef long long int64;
+typedef unsigned int uint32;
+typedef int int32;
+typedef unsigned short uint16;
+typedef unsigned char uchar;
+typedef unsigned char uint8;
+typedef size_t asize_t;
+#ifdef __EA64__
+typedef uint64 ea_t;
+#else
+typedef uint32 ea_t;
+#endif
+
+#define BADADDR   ea_t(-1)
+#define QMAXPATH  260
+#define MAXSTR    1024
+
+#define qnumber(x) (sizeof(x) / sizeof((x)[0]))
+#define CASSERT_CAT2(a, b) a##b
+#define CASSERT_CAT(a, b) CASSERT_CAT2(a, b)
+#define CASSERT(x) typedef char CASSERT_CAT(__cassert_, __LINE__)[(x) ? 1 : -1]
+
+template <class T> inline T qmin(const T &a, const T &b) { return a < b ? a : b; }
+template <class T> inline T qmax(const T &a, const T &b) { return a > b ? a : b; }
+
+//--------------------------------------------------------------------------
+template <class T> class qvector: public std::vector<T>
+{
+  typedef std::vector<T> base;
+public:
+  qvector() {}
+  explicit qvector(size_t n): base(n) {}
+  qvector(size_t n, const T &v): base(n, v) {}
+  using base::push_back;
+  T &push_back() { base::push_back(T()); return base::back(); }
+  void qclear() { base().swap(*this); }
+  void truncate() { base(*this).swap(*this); }
+  bool has(const T &v) const { return std::find(this->begin(), this->end(), v) != this->end(); }
+  bool add_unique(const T &v) { if (has(v)) return false; push_back(v); return true; }
+};
+typedef qvector<int> intvec_t;
+typedef qvector<uint64> uint64vec_t;
+typedef qvector<ea_t> eavec_t;
+typedef qvector<uchar> bytevec_t;
+
+//--------------------------------------------------------------------------
+class qstring
+{
+  std::string s;
+public:
+  qstring() {}
+  qstring(const char *p): s(p) {}
+  const char *c_str() const { return s.c_str(); }
+  size_t length() const { return s.length(); }
+  bool empty() const { return s.empty(); }
+  void qclear() { s.clear(); }
+  qstring &append(const char *p) { s += p; return *this; }
+  qstring &append(char c) { s += c; return *this; }
+  qstring &operator+=(const char *p) { s += p; return *this; }
+  bool operator==(const qstring &o) const { return s == o.s; }
+  bool operator<(const qstring &o) const { return s < o.s; }
+};
+
+//--------------------------------------------------------------------------
+int msg(const char *format, ...);
+int qsnprintf(char *buf, size_t size, const char *format, ...);
+
+typedef struct __qmutex_t {} *qmutex_t;
+qmutex_t qmutex_create();
+bool qmutex_free(qmutex_t m);
+bool qmutex_lock(qmutex_t m);
+bool qmutex_unlock(qmutex_t m);
+
+//--------------------------------------------------------------------------
+FILE *qfopen(const char *file, const char *mode);
+int qfclose(FILE *fp);
+ssize_t qfread(FILE *fp, void *buf, size_t n);
+ssize_t qfwrite(FILE *fp, const void *buf, size_t n);
+int qfseek64(FILE *fp, int64 offset, int whence);
+char *qtmpnam(char *buf, size_t bufsize);
+int qunlink(const char *file);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _UA_HPP
+#define _UA_HPP
+#include "pro.h"
+
+#define UA_MAXOP 6
+
+enum
+{
+  o_void, o_reg, o_mem, o_phrase, o_displ, o_imm, o_far, o_near,
+  o_idpspec0, o_idpspec1, o_idpspec2, o_idpspec3, o_idpspec4, o_idpspec5,
+  o_last
+};
+typedef uchar optype_t;
+
+struct op_t
+{
+  char n;
+  optype_t type;
+};
+
+struct insn_t
+{
+  ea_t ea;
+  uint16 itype;
+  uint16 size;
+  op_t Operands[UA_MAXOP];
+};
+
+// The shim has no database: no instruction can be decoded
+extern insn_t cmd;
+int idaapi decode_insn(ea_t ea);
+
+#endif
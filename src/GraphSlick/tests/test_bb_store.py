@@ -0,0 +1,156 @@
+"""
+Round trip tests of the basic block store (src/bbgroup/bb_store.py).
+They only use the pure Python modules and run without IDA:
+
+    python2 test_bb_store.py
+"""
+
+import os
+import sys
+import shutil
+import tempfile
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'bbgroup'))
+
+from bb_types import BBDef, BBMan
+from bb_store import BBStore, DIGEST_SIZE
+
+# ------------------------------------------------------------------------------
+class Ctx(object):
+    """Block features as the IDA contexts hold them"""
+    pass
+
+
+# ------------------------------------------------------------------------------
+def make_blocks(seed, count):
+    """Return a chain of blocks with a back edge and all the features set"""
+    blocks = []
+    for i in xrange(count):
+        ctx = Ctx()
+        ctx.inst_count = 2 + (seed + i) % 5
+        ctx.hash_itype1 = ('%02x' % ((seed * 7 + i) % 256)) * 20
+        ctx.hash_itype2 = ('%02x' % ((seed * 3 + i) % 256)) * 16
+        ctx.bytes = ''.join(chr((seed + i + k) % 256) for k in xrange(ctx.inst_count * 3))
+        ctx.insns = [(seed + i + k, tuple(range(k % 3))) for k in xrange(ctx.inst_count)]
+        ctx.freq_table = (ctx.inst_count, {(seed + i) * (1 << 40) + 1: ctx.inst_count - 1, 7: 1})
+
+        bb = BBDef(id=i, start=0x1000 + seed * 0x100 + i * 0x10, end=0x1000 + seed * 0x100 + i * 0x10 + 8, ctx=ctx)
+        bb.succs = [i + 1] if i + 1 < count else [0]
+        bb.preds = [i - 1] if i > 0 else [count - 1]
+        blocks.append(bb)
+    return blocks
+
+
+# ------------------------------------------------------------------------------
+def block_digests(blocks):
+    return dict((bb.id, chr(bb.id % 256) * DIGEST_SIZE) for bb in blocks)
+
+
+# ------------------------------------------------------------------------------
+class TestBBStore(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        self.filename = os.path.join(self.dir, 'test.bbs')
+
+
+    def tearDown(self):
+        shutil.rmtree(self.dir, ignore_errors=True)
+
+
+    def check_record(self, rec, blocks, digest):
+        self.assertEqual(rec.digest, digest)
+        self.assertEqual(rec.count, len(blocks))
+        for i, (id, start, end, icount, flags) in enumerate(rec.blocks()):
+            bb = blocks[i]
+            self.assertEqual((id, start, end, icount), (bb.id, bb.start, bb.end, bb.ctx.inst_count))
+            self.assertEqual(rec.succs(i), bb.succs)
+            self.assertEqual(rec.preds(i), bb.preds)
+            self.assertEqual(rec.hash_itype1(i), bb.ctx.hash_itype1)
+            self.assertEqual(rec.hash_itype2(i), bb.ctx.hash_itype2)
+            self.assertEqual(rec.bytes(i), bb.ctx.bytes)
+            self.assertEqual(rec.insns(i), bb.ctx.insns)
+            self.assertEqual(rec.freq_table(i), bb.ctx.freq_table)
+        self.assertEqual(rec.block_digests(), block_digests(blocks))
+
+
+    def test_round_trip(self):
+        st = BBStore(self.filename)
+        funcs = {}
+        for seed in xrange(5):
+            blocks = make_blocks(seed, 3 + seed)
+            funcs[0x1000 + seed] = (blocks, chr(seed) * DIGEST_SIZE)
+            self.assertEqual(st.save(0x1000 + seed, blocks, funcs[0x1000 + seed][1], block_digests(blocks)), (True, None))
+
+        self.assertEqual(st.functions(), sorted(funcs))
+        for ea, (blocks, digest) in funcs.items():
+            self.check_record(st.get(ea), blocks, digest)
+        self.assertTrue(st.get(0x9999) is None)
+        st.close()
+
+        # The records are read back from the file
+        st = BBStore(self.filename)
+        for ea, (blocks, digest) in funcs.items():
+            self.check_record(st.get(ea), blocks, digest)
+        st.close()
+
+
+    def test_replace_and_compact(self):
+        st = BBStore(self.filename)
+        other = make_blocks(1, 4)
+        st.save(0x2000, other, 'o' * DIGEST_SIZE, block_digests(other))
+        for seed in xrange(20):
+            blocks = make_blocks(seed, 6)
+            st.save(0x1000, blocks, chr(seed) * DIGEST_SIZE, block_digests(blocks))
+
+        # The last save wins and the replaced records were reclaimed
+        self.check_record(st.get(0x1000), blocks, chr(19) * DIGEST_SIZE)
+        self.check_record(st.get(0x2000), other, 'o' * DIGEST_SIZE)
+        size = os.path.getsize(self.filename)
+        st.compact()
+        self.assertTrue(os.path.getsize(self.filename) <= size)
+        self.check_record(st.get(0x1000), blocks, chr(19) * DIGEST_SIZE)
+        st.close()
+
+
+    def test_load_store(self):
+        st = BBStore(self.filename)
+        blocks = make_blocks(3, 5)
+        bm = BBMan()
+        for bb in blocks:
+            bm.add(bb)
+        self.assertTrue(bm.save_store(st, 0x3000, 'd' * DIGEST_SIZE, block_digests(blocks)))
+
+        loaded = BBMan()
+        self.assertTrue(loaded.load_store(st, 0x3000, lambda rec, i, icount, flags: rec.freq_table(i)))
+        for bb in blocks:
+            got = loaded[bb.id]
+            self.assertEqual((got.start, got.end, got.succs, got.preds), (bb.start, bb.end, bb.succs, bb.preds))
+            self.assertEqual(got.ctx, bb.ctx.freq_table)
+        self.assertFalse(loaded.load_store(st, 0x4000, None))
+        st.close()
+
+
+    def test_corrupted_record_is_a_miss(self):
+        st = BBStore(self.filename)
+        blocks = make_blocks(2, 4)
+        st.save(0x1000, blocks, 'c' * DIGEST_SIZE, block_digests(blocks))
+        st.close()
+
+        # Flip a byte in the middle of the record
+        with open(self.filename, 'r+b') as f:
+            f.seek(64)
+            b = f.read(1)
+            f.seek(64)
+            f.write(chr(ord(b) ^ 0xFF))
+
+        st = BBStore(self.filename)
+        self.assertTrue(st.get(0x1000) is None)
+        self.assertEqual(st.save(0x1000, blocks, 'c' * DIGEST_SIZE, block_digests(blocks)), (True, None))
+        self.check_record(st.get(0x1000), blocks, 'c' * DIGEST_SIZE)
+        st.close()
+
+
+# ------------------------------------------------------------------------------
+if __name__ == '__main__':
+    unittest.main()
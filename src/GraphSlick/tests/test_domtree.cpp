@@ -0,0 +1,194 @@
+#include "testutil.h"
+#include "domtree.h"
+
+//--------------------------------------------------------------------------
+static void add_edge(qflow_chart_t &fc, int a, int b)
+{
+  fc.blocks[a].succ.push_back(b);
+  fc.blocks[b].pred.push_back(a);
+}
+
+//--------------------------------------------------------------------------
+static void build_tree(qflow_chart_t &fc, domtree_t &doms)
+{
+  adjlist_t succs, preds;
+  succs.build(fc, false);
+  preds.build(fc, true);
+  doms.build(succs, preds, 0);
+}
+
+//--------------------------------------------------------------------------
+// Iterative data flow dominator sets: bit 'a' of dom[b] is set if 'a'
+// dominates 'b'. The unreachable nodes have no dominator
+static void ref_dominators(const qflow_chart_t &fc, qvector<uint64> &dom)
+{
+  int n = fc.size();
+  qvector<bool> reach(n, false);
+  intvec_t stack;
+  stack.push_back(0);
+  reach[0] = true;
+  while (!stack.empty())
+  {
+    int x = stack.back();
+    stack.pop_back();
+    for (int i=0; i < fc.nsucc(x); i++)
+    {
+      if (!reach[fc.succ(x, i)])
+      {
+        reach[fc.succ(x, i)] = true;
+        stack.push_back(fc.succ(x, i));
+      }
+    }
+  }
+
+  dom.resize(n);
+  for (int x=0; x < n; x++)
+    dom[x] = x == 0 ? 1 : (reach[x] ? ~0ULL : 0);
+
+  for (bool changed=true; changed; )
+  {
+    changed = false;
+    for (int x=1; x < n; x++)
+    {
+      if (!reach[x])
+        continue;
+      uint64 d = ~0ULL;
+      for (int i=0; i < fc.npred(x); i++)
+      {
+        if (reach[fc.pred(x, i)])
+          d &= dom[fc.pred(x, i)];
+      }
+      d |= 1ULL << x;
+      if (d != dom[x])
+      {
+        dom[x] = d;
+        changed = true;
+      }
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+static void check_against_ref(const qflow_chart_t &fc, const domtree_t &doms)
+{
+  int n = fc.size();
+  qvector<uint64> dom;
+  ref_dominators(fc, dom);
+  for (int b=0; b < n; b++)
+  {
+    CHECK(doms.is_reachable(b) == (dom[b] != 0));
+
+    int size = 0;
+    for (int a=0; a < n; a++)
+    {
+      bool ref = (dom[b] >> a & 1) != 0;
+      CHECK(doms.dominates(a, b) == ref);
+      if ((dom[a] >> b & 1) != 0)
+        ++size;
+    }
+    CHECK(doms.get_subtree_size(b) == size);
+
+    // The immediate dominator is the strict dominator dominated by all
+    // the other ones
+    int idom = -1;
+    if (b != 0 && dom[b] != 0)
+    {
+      uint64 strict = dom[b] & ~(1ULL << b);
+      for (int a=0; a < n; a++)
+      {
+        if ((strict >> a & 1) != 0 && (dom[a] & strict) == strict)
+          idom = a;
+      }
+    }
+    CHECK(doms.get_idom(b) == idom);
+  }
+}
+
+//--------------------------------------------------------------------------
+static void test_small_graphs()
+{
+  // Diamond with a loop back to the head: 0 -> 1 -> {2, 3} -> 4 -> 1, 4 -> 5
+  qflow_chart_t fc;
+  fc.blocks.resize(6);
+  add_edge(fc, 0, 1);
+  add_edge(fc, 1, 2);
+  add_edge(fc, 1, 3);
+  add_edge(fc, 2, 4);
+  add_edge(fc, 3, 4);
+  add_edge(fc, 4, 1);
+  add_edge(fc, 4, 5);
+
+  domtree_t doms;
+  build_tree(fc, doms);
+  CHECK(doms.get_idom(0) == -1);
+  CHECK(doms.get_idom(1) == 0);
+  CHECK(doms.get_idom(2) == 1);
+  CHECK(doms.get_idom(3) == 1);
+  CHECK(doms.get_idom(4) == 1);
+  CHECK(doms.get_idom(5) == 4);
+  CHECK(!doms.dominates(2, 4));
+  CHECK(doms.get_subtree_size(1) == 5);
+  check_against_ref(fc, doms);
+
+  // Irreducible loop entered at 1 and 2, and an unreachable block 4
+  qflow_chart_t irr;
+  irr.blocks.resize(5);
+  add_edge(irr, 0, 1);
+  add_edge(irr, 0, 2);
+  add_edge(irr, 1, 2);
+  add_edge(irr, 2, 1);
+  add_edge(irr, 2, 3);
+  add_edge(irr, 4, 3);
+  build_tree(irr, doms);
+  CHECK(doms.get_idom(1) == 0);
+  CHECK(doms.get_idom(2) == 0);
+  CHECK(doms.get_idom(3) == 2);
+  CHECK(!doms.is_reachable(4));
+  CHECK(!doms.dominates(4, 4));
+  check_against_ref(irr, doms);
+
+  // Duplicate edges and a self loop
+  qflow_chart_t dup;
+  dup.blocks.resize(3);
+  add_edge(dup, 0, 1);
+  add_edge(dup, 0, 1);
+  add_edge(dup, 1, 1);
+  add_edge(dup, 1, 2);
+  build_tree(dup, doms);
+  check_against_ref(dup, doms);
+}
+
+//--------------------------------------------------------------------------
+static void test_random_graphs()
+{
+  test_rand_t rnd(6);
+  for (int iter=0; iter < 2000; iter++)
+  {
+    int n = 1 + rnd.below(40);
+    qflow_chart_t fc;
+    fc.blocks.resize(n);
+
+    // Mostly forward edges, some back edges and some missing ones
+    for (int x=0; x < n; x++)
+    {
+      int nsucc = rnd.below(3);
+      for (int k=0; k < nsucc; k++)
+      {
+        int y = rnd.below(5) == 0 ? rnd.below(n) : qmin(n - 1, x + 1 + rnd.below(4));
+        add_edge(fc, x, y);
+      }
+    }
+
+    domtree_t doms;
+    build_tree(fc, doms);
+    check_against_ref(fc, doms);
+  }
+}
+
+//--------------------------------------------------------------------------
+int main()
+{
+  test_small_graphs();
+  test_random_graphs();
+  return test_result("domtree");
+}
@@ -0,0 +1,94 @@
+#include "testutil.h"
+#include "bbfeatures.h"
+
+//--------------------------------------------------------------------------
+// Plain Levenshtein distance
+static int ref_distance(const qvector<uint32> &a, const qvector<uint32> &b)
+{
+  intvec_t prev, cur;
+  prev.resize(b.size() + 1);
+  cur.resize(b.size() + 1);
+  for (size_t j=0; j <= b.size(); j++)
+    prev[j] = int(j);
+
+  for (size_t i=1; i <= a.size(); i++)
+  {
+    cur[0] = int(i);
+    for (size_t j=1; j <= b.size(); j++)
+    {
+      int sub = prev[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1);
+      cur[j] = qmin(sub, qmin(prev[j], cur[j - 1]) + 1);
+    }
+    prev.swap(cur);
+  }
+  return prev[b.size()];
+}
+
+//--------------------------------------------------------------------------
+// A copy of 'src' with a few edits
+static void mutate(test_rand_t &rnd, const qvector<uint32> &src, qvector<uint32> &dst, int alphabet)
+{
+  dst = src;
+  for (int k=rnd.below(6); k > 0; k--)
+  {
+    int op = rnd.below(3);
+    if (op == 0 || dst.empty())
+      dst.insert(dst.begin() + rnd.below(int(dst.size()) + 1), uint32(rnd.below(alphabet)));
+    else if (op == 1)
+      dst.erase(dst.begin() + rnd.below(int(dst.size())));
+    else
+      dst[rnd.below(int(dst.size()))] = uint32(rnd.below(alphabet));
+  }
+}
+
+//--------------------------------------------------------------------------
+// The bit-parallel distance (patterns of 64 itypes or less) and the
+// dynamic programming one (longer patterns) against the reference
+static void test_distance(int max_len)
+{
+  test_rand_t rnd(4 + max_len);
+  edit_pattern_t pat;
+  qvector<uint32> a, b;
+  for (int iter=0; iter < 3000; iter++)
+  {
+    int alphabet = 2 + rnd.below(20);
+    a.resize(rnd.below(max_len + 1));
+    for (size_t i=0; i < a.size(); i++)
+      a[i] = uint32(rnd.below(alphabet));
+
+    if (rnd.below(2) == 0)
+    {
+      mutate(rnd, a, b, alphabet);
+    }
+    else
+    {
+      b.resize(rnd.below(max_len + 1));
+      for (size_t i=0; i < b.size(); i++)
+        b[i] = uint32(rnd.below(alphabet));
+    }
+
+    int ref = ref_distance(a, b);
+    pat.compile(a.empty() ? NULL : &a[0], int(a.size()), alphabet);
+    const uint32 *text = b.empty() ? NULL : &b[0];
+
+    int n = int(qmax(a.size(), b.size()));
+    CHECK(pat.distance(text, int(b.size()), n) == ref);
+
+    // Past the limit only "more than max_dist" is known
+    int max_dist = rnd.below(8);
+    int d = pat.distance(text, int(b.size()), max_dist);
+    if (ref <= max_dist)
+      CHECK(d == ref);
+    else
+      CHECK(d > max_dist);
+  }
+}
+
+//--------------------------------------------------------------------------
+int main()
+{
+  test_distance(20);
+  test_distance(64);
+  test_distance(150);
+  return test_result("edit");
+}
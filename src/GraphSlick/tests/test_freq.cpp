@@ -0,0 +1,92 @@
+#include "testutil.h"
+#include "bbfeatures.h"
+
+//--------------------------------------------------------------------------
+// Scalar merge of the sorted keys
+static void ref_intersect(
+    const freqtable_t &ft1,
+    const freqtable_t &ft2,
+    freq_intersection_t &r)
+{
+  r.comm_count = r.sum1 = r.sum2 = 0;
+  r.tp = 0;
+  hash64_t h;
+  size_t i = 0, j = 0;
+  while (i < ft1.keys.size() && j < ft2.keys.size())
+  {
+    if (ft1.keys[i] < ft2.keys[j])
+    {
+      ++i;
+    }
+    else if (ft2.keys[j] < ft1.keys[i])
+    {
+      ++j;
+    }
+    else
+    {
+      int v1 = ft1.counts[i], v2 = ft2.counts[j];
+      ++r.comm_count;
+      r.sum1 += v1;
+      r.sum2 += v2;
+      r.tp += double(qmin(v1, v2) * 100) / double(qmax(v1, v2));
+      h.update(uint64(ft1.keys[i]));
+      ++i;
+      ++j;
+    }
+  }
+  r.hash = h.digest();
+}
+
+//--------------------------------------------------------------------------
+static void random_table(test_rand_t &rnd, int count, int range, freqtable_t &ft)
+{
+  ft.keys.qclear();
+  ft.counts.qclear();
+  ft.total = 0;
+  for (int k=0; k < range && int(ft.keys.size()) < count; k++)
+  {
+    if (rnd.below(range) >= count)
+      continue;
+    ft.keys.push_back(uint32(k) * 7919);
+    ft.counts.push_back(1 + rnd.below(9));
+    ft.total += ft.counts.back();
+  }
+}
+
+//--------------------------------------------------------------------------
+// The SSE2 block comparison (tables of 4 keys or more, when the compiler
+// targets SSE2) against the scalar merge
+static void test_intersect()
+{
+  test_rand_t rnd(5);
+  freqtable_t ft1, ft2;
+  for (int iter=0; iter < 20000; iter++)
+  {
+    int range = 1 + rnd.below(120);
+    random_table(rnd, rnd.below(40), range, ft1);
+    random_table(rnd, rnd.below(40), range, ft2);
+
+    freq_intersection_t r, ref;
+    intersect_freq_tables(ft1, ft2, r);
+    ref_intersect(ft1, ft2, ref);
+    CHECK(r.comm_count == ref.comm_count);
+    CHECK(r.sum1 == ref.sum1);
+    CHECK(r.sum2 == ref.sum2);
+    CHECK(r.tp == ref.tp);
+    CHECK(r.hash == ref.hash);
+  }
+
+  // A table against itself has all its keys in common
+  random_table(rnd, 30, 60, ft1);
+  freq_intersection_t r;
+  intersect_freq_tables(ft1, ft1, r);
+  CHECK(r.comm_count == int(ft1.keys.size()));
+  CHECK(r.sum1 == ft1.total && r.sum2 == ft1.total);
+}
+
+//--------------------------------------------------------------------------
+int main()
+{
+  test_intersect();
+  return test_result("freq");
+}
@@ -0,0 +1,98 @@
+#include "testutil.h"
+#include "hashtab.h"
+#include <map>
+
+//--------------------------------------------------------------------------
+// Keys with the same low bits all probe from the same slot
+static uint64 colliding_key(int i)
+{
+  return uint64(i + 1) << 40;
+}
+
+//--------------------------------------------------------------------------
+static void fill_and_check(digest_index_t &index, int count)
+{
+  for (int i=0; i < count; i++)
+    CHECK(index.insert(colliding_key(i), i) == i);
+
+  // Inserting again keeps the first value
+  for (int i=0; i < count; i++)
+    CHECK(index.insert(colliding_key(i), i + count) == i);
+
+  CHECK(index.size() == size_t(count));
+  for (int i=0; i < count; i++)
+    CHECK(index.find(colliding_key(i)) == i);
+  CHECK(index.find(colliding_key(count)) == -1);
+}
+
+//--------------------------------------------------------------------------
+static void test_digest_index()
+{
+  digest_index_t index;
+  CHECK(index.size() == 0);
+  CHECK(index.find(1) == -1);
+  fill_and_check(index, 1000);
+
+  // A cleared index is reused with more keys than its initial slots
+  index.clear();
+  CHECK(index.size() == 0);
+  CHECK(index.find(colliding_key(0)) == -1);
+  fill_and_check(index, 100);
+  CHECK(index.get_memory_size() >= 2 * 100 * sizeof(int));
+
+  // Key 0 is a valid key
+  digest_index_t zero(4);
+  CHECK(zero.insert(0, 7) == 7);
+  CHECK(zero.find(0) == 7);
+}
+
+//--------------------------------------------------------------------------
+static void test_digest_map()
+{
+  test_rand_t rnd(1);
+  digest_map_t<intvec_t> map;
+  std::map<uint64, intvec_t> ref;
+  qvector<uint64> inserted;
+  for (int i=0; i < 5000; i++)
+  {
+    uint64 key = uint64(rnd.below(700)) * 0x9E3779B97F4A7C15ULL;
+    if (ref.find(key) == ref.end())
+      inserted.push_back(key);
+    map[key].push_back(i);
+    ref[key].push_back(i);
+  }
+
+  CHECK(map.size() == ref.size());
+  for (size_t i=0; i < inserted.size(); i++)
+  {
+    // Entries are kept in insertion order
+    CHECK(map.get_key(i) == inserted[i]);
+    CHECK(map.get_value(i) == ref[inserted[i]]);
+
+    const intvec_t *v = map.find(inserted[i]);
+    CHECK(v != NULL && *v == ref[inserted[i]]);
+  }
+  CHECK(map.find(12345) == NULL);
+
+  // The sorted order only depends on the keys
+  intvec_t order;
+  map.get_sorted_order(order);
+  CHECK(order.size() == ref.size());
+  std::map<uint64, intvec_t>::const_iterator it = ref.begin();
+  for (size_t i=0; i < order.size(); i++, ++it)
+    CHECK(map.get_key(order[i]) == it->first);
+
+  map.clear();
+  CHECK(map.empty());
+  CHECK(map.find(inserted[0]) == NULL);
+  map[inserted[0]].push_back(1);
+  CHECK(map.size() == 1 && map.get_value(0).size() == 1);
+}
+
+//--------------------------------------------------------------------------
+int main()
+{
+  test_digest_index();
+  test_digest_map();
+  return test_result("hashtab");
+}
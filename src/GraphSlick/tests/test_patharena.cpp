@@ -0,0 +1,137 @@
+#include "testutil.h"
+#include "patharena.h"
+
+//--------------------------------------------------------------------------
+static void random_path(test_rand_t &rnd, intvec_t &path)
+{
+  path.resize(rnd.below(40));
+  for (size_t i=0; i < path.size(); i++)
+  {
+    // Mostly close nodes, some far and negative steps
+    int r = rnd.below(10);
+    if (r == 0)
+      path[i] = rnd.below(2000000000);
+    else if (i > 0)
+      path[i] = qmax(0, path[i - 1] + rnd.below(21) - 10);
+    else
+      path[i] = rnd.below(100);
+  }
+}
+
+//--------------------------------------------------------------------------
+static void test_pack()
+{
+  test_rand_t rnd(2);
+  qvector<intvec_t> paths;
+  bytevec_t bytes;
+  for (int i=0; i < 500; i++)
+  {
+    random_path(rnd, paths.push_back());
+    pack_path(bytes, paths.back());
+  }
+
+  // The paths are decoded back to back
+  const uchar *ptr = &bytes[0];
+  intvec_t path;
+  for (size_t i=0; i < paths.size(); i++)
+  {
+    ptr = unpack_path(ptr, path);
+    CHECK(path == paths[i]);
+  }
+  CHECK(ptr == &bytes[0] + bytes.size());
+
+  // Small steps take one byte per node
+  intvec_t seq;
+  for (int i=0; i < 10; i++)
+    seq.push_back(100 + i);
+  bytes.qclear();
+  pack_path(bytes, seq);
+  CHECK(bytes.size() == 1 + 2 + 9);
+}
+
+//--------------------------------------------------------------------------
+static size_t check_arena(size_t budget)
+{
+  test_rand_t rnd(3);
+  path_arena_t arena;
+  arena.set_budget(budget);
+
+  qvector<intvec_t> paths;
+  intvec_t ids;
+  for (int i=0; i < 3000; i++)
+  {
+    // Some paths are added again
+    if (i > 0 && rnd.below(4) == 0)
+    {
+      int j = rnd.below(int(paths.size()));
+      CHECK(arena.add(paths[j]) == ids[j]);
+      continue;
+    }
+    intvec_t &path = paths.push_back();
+    random_path(rnd, path);
+
+    int id = arena.add(path, hash_path(path));
+    bool dup = false;
+    for (size_t j=0; j < paths.size() - 1 && !dup; j++)
+    {
+      if (paths[j] == path)
+      {
+        CHECK(id == ids[j]);
+        dup = true;
+      }
+    }
+    if (!dup)
+      CHECK(id == arena.size() - 1);
+    ids.push_back(id);
+  }
+
+  intvec_t path;
+  for (size_t i=0; i < paths.size(); i++)
+  {
+    CHECK(arena.get_path_size(ids[i]) == int(paths[i].size()));
+    arena.get(ids[i], path);
+    CHECK(path == paths[i]);
+  }
+
+  size_t size = arena.get_memory_size();
+  arena.clear();
+  CHECK(arena.size() == 0);
+  CHECK(arena.add(paths[0]) == 0);
+  return size;
+}
+
+//--------------------------------------------------------------------------
+static void test_pathlist()
+{
+  path_arena_t arena;
+  arena_pathlist_t list1, list2;
+  intvec_t a, b;
+  a.push_back(1); a.push_back(2); a.push_back(3);
+  b.push_back(1); b.push_back(3);
+
+  CHECK(list1.add_path(arena, a));
+  CHECK(!list1.add_path(arena, a));
+  CHECK(list1.add_path(arena, b));
+  CHECK(list1.size() == 2);
+
+  // The same path in another list shares its arena index
+  CHECK(list2.add_path(arena, b));
+  CHECK(list2.get_id(0) == list1.get_id(1));
+  CHECK(arena.size() == 2);
+  CHECK(!list2.add_id(list1.get_id(1), hash_path(b)));
+  CHECK(list2.add_id(list1.get_id(0), hash_path(a)));
+}
+
+//--------------------------------------------------------------------------
+int main()
+{
+  test_pack();
+
+  // Past the budget the packed bytes are spilled, not the per path data
+  size_t unbounded = check_arena(0);
+  size_t bounded = check_arena(4096);
+  CHECK(bounded < unbounded);
+  CHECK(check_arena(1) <= bounded);
+  test_pathlist();
+  return test_result("patharena");
+}
@@ -0,0 +1,59 @@
+#ifndef __TESTUTIL__
+#define __TESTUTIL__
+
+/*--------------------------------------------------------------------------
+Checks shared by the standalone tests. A test program returns the count of
+failed checks
+--------------------------------------------------------------------------*/
+
+#include <pro.h>
+
+static int g_failed = 0;
+
+#define CHECK(cond)                                                   \
+  do                                                                  \
+  {                                                                   \
+    if (!(cond))                                                      \
+    {                                                                 \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++g_failed;                                                     \
+    }                                                                 \
+  } while (0)
+
+//--------------------------------------------------------------------------
+/**
+* @brief Deterministic pseudo random numbers (xorshift)
+*/
+class test_rand_t
+{
+  uint64 s;
+public:
+  test_rand_t(uint64 seed): s(seed * 2 + 1)
+  {
+  }
+
+  uint32 next()
+  {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return uint32(s >> 16);
+  }
+
+  /**
+  * @brief Return a number in [0, n)
+  */
+  int below(int n)
+  {
+    return int(next() % uint32(n));
+  }
+};
+
+//--------------------------------------------------------------------------
+static int test_result(const char *name)
+{
+  printf("%s: %s\n", name, g_failed == 0 ? "ok" : "FAILED");
+  return g_failed == 0 ? 0 : 1;
+}
+
+#endif
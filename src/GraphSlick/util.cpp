@@ -1,3 +1,9 @@
+#ifdef __NT__
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
 #include "util.h"
 #include <kernwin.hpp>
 #include <prodir.h>
@@ -124,3 +130,16 @@ bool is_ida_gui()
 {
   return callui(ui_get_hwnd).vptr != NULL || is_idaq();
 }
+
+//--------------------------------------------------------------------------
+int get_cpu_count()
+{
+#ifdef __NT__
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int n = int(si.dwNumberOfProcessors);
+#else
+  int n = int(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+  return n < 1 ? 1 : n;
+}
@@ -89,4 +89,10 @@ bool is_ida_gui();
 */
 const char *get_screen_function_fn(const char *ext = ".bin");
 
+//--------------------------------------------------------------------------
+/**
+* @brief Returns the number of processors (at least 1)
+*/
+int get_cpu_count();
+
 #endif
\ No newline at end of file